@@ -0,0 +1,437 @@
+#include "bind.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "lexer.h"
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+// seeds tried per table size before the table is doubled
+#define BIND_MAX_SEEDS 64
+
+// numbers are converted from a nul terminated copy of the lexeme, made on
+// the stack unless the lexeme is longer than this
+#define BIND_NUMBER_LENGTH 64
+
+static uint64_t key_hash(const char *key, size_t len, uint64_t seed) {
+    uint64_t h = FNV_OFFSET_BASIS ^ (seed * FNV_PRIME);
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)key[i];
+        h *= FNV_PRIME;
+    }
+    return h ^ (h >> 32);
+}
+
+static bool binding_place(JsonBinding *binding, int *slots, size_t mask,
+                          uint64_t seed) {
+    for (size_t i = 0; i <= mask; i++)
+        slots[i] = -1;
+
+    for (size_t i = 0; i < binding->n_fields; i++) {
+        const char *name = binding->fields[i].name;
+        size_t slot = key_hash(name, strlen(name), seed) & mask;
+        if (slots[slot] != -1)
+            return false;
+        slots[slot] = i;
+    }
+    return true;
+}
+
+// checks the fields of binding and of every binding reachable from it, the
+// visiting mark stops the walk at cycles
+static bool binding_check(JsonBinding *binding) {
+    if (binding->slots != NULL || binding->visiting)
+        return true;
+
+    bool ok = true;
+    binding->visiting = true;
+
+    for (size_t i = 0; ok && i < binding->n_fields; i++) {
+        const JsonField *field = &binding->fields[i];
+
+        for (size_t j = 0; ok && j < i; j++) {
+            if (strcmp(binding->fields[j].name, field->name) == 0) {
+                LOG_ERROR("binding: duplicate field \"%s\"", field->name);
+                ok = false;
+            }
+        }
+
+        if (ok && field->type == JSON_FIELD_ARRAY &&
+            field->element == JSON_FIELD_ARRAY) {
+            LOG_ERROR("binding: field \"%s\" is an array of arrays",
+                      field->name);
+            ok = false;
+        }
+
+        bool nested = field->type == JSON_FIELD_OBJECT ||
+                      (field->type == JSON_FIELD_ARRAY &&
+                       field->element == JSON_FIELD_OBJECT);
+        if (ok && nested && field->binding == NULL) {
+            LOG_ERROR("binding: field \"%s\" has no nested binding",
+                      field->name);
+            ok = false;
+        }
+
+        if (ok && field->binding != NULL)
+            ok = binding_check(field->binding);
+    }
+
+    binding->visiting = false;
+    return ok;
+}
+
+// searches for a seed under which every field name lands in its own slot
+static bool binding_build(JsonBinding *binding) {
+    if (binding->slots != NULL)
+        return true;
+
+    size_t size = 1;
+    while (size < binding->n_fields * 2)
+        size <<= 1;
+
+    int *slots = NULL;
+    bool placed = false;
+
+    while (!placed) {
+        int *grown = (int *)realloc(slots, sizeof(int) * size);
+        if (grown == NULL) {
+            LOG_ERROR("failed to allocate memory for binding: %s",
+                      strerror(errno));
+            free(slots);
+            return false;
+        }
+        slots = grown;
+
+        for (uint64_t seed = 0; seed < BIND_MAX_SEEDS && !placed; seed++) {
+            placed = binding_place(binding, slots, size - 1, seed);
+            binding->seed = seed;
+        }
+
+        if (!placed)
+            size <<= 1;
+    }
+
+    // set before recursing so that self-referencing bindings terminate
+    binding->mask = size - 1;
+    binding->slots = slots;
+
+    for (size_t i = 0; i < binding->n_fields; i++) {
+        JsonBinding *nested = binding->fields[i].binding;
+        if (nested != NULL && !binding_build(nested))
+            return false;
+    }
+    return true;
+}
+
+// drops the tables of binding and the bindings reachable from it
+static void binding_reset(JsonBinding *binding) {
+    if (binding->slots == NULL)
+        return;
+
+    free(binding->slots);
+    binding->slots = NULL;
+
+    for (size_t i = 0; i < binding->n_fields; i++) {
+        if (binding->fields[i].binding != NULL)
+            binding_reset(binding->fields[i].binding);
+    }
+}
+
+// a binding only has slots once every binding reachable from it has them
+// too, so a failed compile leaves nothing half built for the next call
+bool json_binding_compile(JsonBinding *binding) {
+    assert(binding != NULL);
+
+    if (binding->slots != NULL)
+        return true;
+
+    if (!binding_check(binding))
+        return false;
+
+    if (!binding_build(binding)) {
+        binding_reset(binding);
+        return false;
+    }
+    return true;
+}
+
+// looks up the field named by the lexeme of a key token
+static int binding_find(const JsonBinding *binding, Token key) {
+    uint64_t h = key_hash(key.ptr, key.len, binding->seed);
+    int i = binding->slots[h & binding->mask];
+    if (i < 0)
+        return -1;
+
+    const char *name = binding->fields[i].name;
+    if (strncmp(name, key.ptr, key.len) == 0 && name[key.len] == 0)
+        return i;
+    return -1;
+}
+
+static size_t element_size(JsonFieldType type, const JsonBinding *binding) {
+    switch (type) {
+    case JSON_FIELD_INT:
+        return sizeof(int64_t);
+    case JSON_FIELD_DOUBLE:
+        return sizeof(double);
+    case JSON_FIELD_BOOL:
+        return sizeof(bool);
+    case JSON_FIELD_STRING:
+        return sizeof(char *);
+    case JSON_FIELD_OBJECT:
+        return binding->size;
+    case JSON_FIELD_ARRAY:
+        return sizeof(JsonBoundArray);
+    }
+    return 0;
+}
+
+static void free_value(JsonFieldType type, JsonFieldType element,
+                       JsonBinding *binding, void *dst) {
+    switch (type) {
+    case JSON_FIELD_STRING:
+        free(*(char **)dst);
+        break;
+    case JSON_FIELD_OBJECT:
+        json_binding_free(binding, dst);
+        break;
+    case JSON_FIELD_ARRAY: {
+        JsonBoundArray *array = (JsonBoundArray *)dst;
+        size_t size = element_size(element, binding);
+        for (size_t i = 0; i < array->n; i++)
+            free_value(element, element, binding,
+                       (char *)array->arr + i * size);
+        free(array->arr);
+        break;
+    }
+    default:
+        break;
+    }
+
+    memset(dst, 0, element_size(type, binding));
+}
+
+void json_binding_free(JsonBinding *binding, void *value) {
+    assert(binding != NULL && value != NULL);
+
+    for (size_t i = 0; i < binding->n_fields; i++) {
+        const JsonField *field = &binding->fields[i];
+        free_value(field->type, field->element, field->binding,
+                   (char *)value + field->offset);
+    }
+}
+
+static void token_error(Lexer *lexer, Token token, const char *expected) {
+    LOG_ERROR_AT(lexer, token.offset, "expected %s but got %s", expected,
+                 get_token_name(token));
+}
+
+static bool decode_object(Lexer *lexer, JsonBinding *binding, void *dst);
+static bool decode_array(Lexer *lexer, JsonFieldType element,
+                         JsonBinding *binding, JsonBoundArray *dst);
+
+static bool decode_number(Token token, JsonFieldType type, void *dst) {
+    char buf[BIND_NUMBER_LENGTH];
+    char *number = buf;
+
+    if (token.len < sizeof(buf)) {
+        memcpy(buf, token.ptr, token.len);
+        buf[token.len] = 0;
+    } else if ((number = strndup(token.ptr, token.len)) == NULL) {
+        LOG_ERROR("failed to allocate memory for number: %s", strerror(errno));
+        return false;
+    }
+
+    if (type == JSON_FIELD_INT)
+        *(int64_t *)dst = strtoll(number, NULL, 10);
+    else
+        *(double *)dst = strtod(number, NULL);
+
+    if (number != buf)
+        free(number);
+    return true;
+}
+
+// decodes the value starting at token into dst, null leaves it zeroed. the
+// lexemes are only viewed, strings are copied into the struct
+static bool decode_value(Lexer *lexer, Token token, JsonFieldType type,
+                         JsonFieldType element, JsonBinding *binding,
+                         void *dst) {
+    const char *expected = NULL;
+
+    if (token.type == TOK_NULL)
+        return true;
+
+    switch (type) {
+    case JSON_FIELD_INT:
+        if (token.type != TOK_NUMBER_INT) {
+            expected = "integer";
+            break;
+        }
+        return decode_number(token, type, dst);
+    case JSON_FIELD_DOUBLE:
+        if (token.type != TOK_NUMBER_INT && token.type != TOK_NUMBER_FLOAT) {
+            expected = "number";
+            break;
+        }
+        return decode_number(token, type, dst);
+    case JSON_FIELD_BOOL:
+        if (token.type != TOK_TRUE && token.type != TOK_FALSE) {
+            expected = "boolean";
+            break;
+        }
+        *(bool *)dst = token.type == TOK_TRUE;
+        return true;
+    case JSON_FIELD_STRING:
+        if (token.type != TOK_STRING) {
+            expected = "string";
+            break;
+        }
+        *(char **)dst = strndup(token.ptr, token.len);
+        if (*(char **)dst == NULL) {
+            LOG_ERROR("failed to allocate memory for string: %s",
+                      strerror(errno));
+            return false;
+        }
+        return true;
+    case JSON_FIELD_OBJECT:
+        if (token.type != TOK_OBJECT_START) {
+            expected = "object";
+            break;
+        }
+        return decode_object(lexer, binding, dst);
+    case JSON_FIELD_ARRAY:
+        if (token.type != TOK_ARRAY_START) {
+            expected = "array";
+            break;
+        }
+        return decode_array(lexer, element, binding, (JsonBoundArray *)dst);
+    }
+
+    token_error(lexer, token, expected);
+    return false;
+}
+
+// the opening bracket has been read
+static bool decode_array(Lexer *lexer, JsonFieldType element,
+                         JsonBinding *binding, JsonBoundArray *dst) {
+    size_t size = element_size(element, binding);
+    size_t capacity = 0;
+
+    Token token = lexer_view_token(lexer);
+
+    while (token.type != TOK_ARRAY_END) {
+        if (dst->n == capacity) {
+            capacity = capacity == 0 ? 8 : capacity * 2;
+            dst->arr = realloc(dst->arr, size * capacity);
+            memset((char *)dst->arr + size * dst->n, 0,
+                   size * (capacity - dst->n));
+        }
+
+        if (!decode_value(lexer, token, element, element, binding,
+                          (char *)dst->arr + size * dst->n++))
+            return false;
+
+        token = lexer_view_token(lexer);
+        if (token.type == TOK_ARRAY_END)
+            break;
+        if (token.type != TOK_COMMA) {
+            token_error(lexer, token, "comma");
+            return false;
+        }
+        token = lexer_view_token(lexer);
+    }
+
+    return true;
+}
+
+// the opening brace has been read
+static bool decode_object(Lexer *lexer, JsonBinding *binding, void *dst) {
+    Token token = lexer_view_token(lexer);
+
+    while (token.type != TOK_OBJECT_END) {
+        if (token.type != TOK_STRING) {
+            token_error(lexer, token, "key");
+            return false;
+        }
+
+        int i = binding_find(binding, token);
+
+        token = lexer_view_token(lexer);
+        if (token.type != TOK_COLON) {
+            token_error(lexer, token, "colon (:)");
+            return false;
+        }
+
+        token = lexer_view_token(lexer);
+        if (i < 0) {
+            if (!lexer_skip_value(lexer, token))
+                return false;
+        } else {
+            const JsonField *field = &binding->fields[i];
+            void *member = (char *)dst + field->offset;
+
+            // a repeated key replaces the earlier value
+            free_value(field->type, field->element, field->binding, member);
+            if (!decode_value(lexer, token, field->type, field->element,
+                              field->binding, member))
+                return false;
+        }
+
+        token = lexer_view_token(lexer);
+        if (token.type == TOK_OBJECT_END)
+            break;
+        if (token.type != TOK_COMMA) {
+            token_error(lexer, token, "comma");
+            return false;
+        }
+        token = lexer_view_token(lexer);
+    }
+
+    return true;
+}
+
+bool json_decode(Source *source, JsonBinding *binding, void *out) {
+    assert(source != NULL && binding != NULL && out != NULL);
+
+    if (!json_binding_compile(binding))
+        return false;
+
+    Lexer *lexer = lexer_init(source);
+    if (lexer == NULL) {
+        LOG_ERROR("failed to initialize lexer: %s", strerror(errno));
+        return false;
+    }
+
+    memset(out, 0, binding->size);
+
+    bool ok = false;
+    Token token = lexer_view_token(lexer);
+    if (token.type == TOK_OBJECT_START) {
+        ok = decode_object(lexer, binding, out);
+    } else {
+        token_error(lexer, token, "object");
+    }
+
+    lexer_free(&lexer);
+
+    if (!ok)
+        json_binding_free(binding, out);
+    return ok;
+}
+
+bool json_decode_file(const char *filepath, JsonBinding *binding, void *out) {
+    Source *source = source_open_file(filepath);
+    if (source == NULL)
+        return false;
+
+    bool ok = json_decode(source, binding, out);
+
+    source_close(&source);
+    return ok;
+}
@@ -0,0 +1,96 @@
+#ifndef __BIND_H__
+#define __BIND_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "source.h"
+
+// Bindings decode json straight into C structs without building a json tree.
+// A binding lists the members of a struct along with their json type:
+//
+//     typedef struct { int64_t id; char *name; JsonBoundArray tags; } User;
+//
+//     static JsonField user_fields[] = {
+//         JSON_FIELD(User, id, JSON_FIELD_INT),
+//         JSON_FIELD(User, name, JSON_FIELD_STRING),
+//         JSON_FIELD_ARRAY(User, tags, JSON_FIELD_STRING, NULL),
+//     };
+//     static JsonBinding user_binding = JSON_BINDING(User, user_fields);
+//
+// Members not present in the input are left zeroed, keys not in the binding
+// are skipped.
+
+typedef enum {
+    JSON_FIELD_INT,    /* int64_t */
+    JSON_FIELD_DOUBLE, /* double */
+    JSON_FIELD_BOOL,   /* bool */
+    JSON_FIELD_STRING, /* char *, owned by the struct */
+    JSON_FIELD_OBJECT, /* nested struct described by another binding */
+    JSON_FIELD_ARRAY   /* JsonBoundArray of elements */
+} JsonFieldType;
+
+typedef struct JsonBinding JsonBinding;
+
+typedef struct {
+    const char *name;
+    JsonFieldType type;
+    size_t offset;
+    JsonFieldType element; /* arrays only: type of the elements */
+    JsonBinding *binding;  /* objects, and arrays of objects */
+} JsonField;
+
+struct JsonBinding {
+    size_t size;
+    const JsonField *fields;
+    size_t n_fields;
+    /* perfect hash of the field names, built on first use */
+    uint64_t seed;
+    size_t mask;
+    int *slots;    /* field index per slot, -1 when empty */
+    bool visiting; /* set while compiling walks through it */
+};
+
+typedef struct {
+    void *arr;
+    size_t n;
+} JsonBoundArray;
+
+#define JSON_FIELD_NAMED(Struct, member, key, field_type)                      \
+    {.name = key, .type = field_type, .offset = offsetof(Struct, member)}
+
+#define JSON_FIELD(Struct, member, field_type)                                 \
+    JSON_FIELD_NAMED(Struct, member, #member, field_type)
+
+#define JSON_FIELD_STRUCT(Struct, member, nested)                              \
+    {.name = #member,                                                          \
+     .type = JSON_FIELD_OBJECT,                                                \
+     .offset = offsetof(Struct, member),                                       \
+     .binding = nested}
+
+#define JSON_FIELD_ARRAY(Struct, member, element_type, nested)                 \
+    {.name = #member,                                                          \
+     .type = JSON_FIELD_ARRAY,                                                 \
+     .offset = offsetof(Struct, member),                                       \
+     .element = element_type,                                                  \
+     .binding = nested}
+
+#define JSON_BINDING(Struct, field_table)                                      \
+    {.size = sizeof(Struct),                                                   \
+     .fields = field_table,                                                    \
+     .n_fields = sizeof(field_table) / sizeof(field_table[0])}
+
+/* builds the key lookup tables of binding and the bindings nested in it.
+ * decoding does this on demand, call it up front when bindings are shared
+ * between threads */
+bool json_binding_compile(JsonBinding *binding);
+
+/* decodes an object into out, which must point to binding->size bytes */
+bool json_decode(Source *source, JsonBinding *binding, void *out);
+bool json_decode_file(const char *filepath, JsonBinding *binding, void *out);
+
+/* frees the strings and arrays owned by a decoded struct */
+void json_binding_free(JsonBinding *binding, void *value);
+
+#endif // __BIND_H__
@@ -0,0 +1,334 @@
+#include "json.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+
+// Cached documents live in a table guarded by a read-write lock. Hits only
+// take the lock shared and bump the reference count and the LRU tick with
+// atomics, so readers of unchanged files never wait on each other. Misses
+// insert a loading entry under the exclusive lock and parse outside of it,
+// later requests for the same file wait for that parse instead of starting
+// their own.
+
+struct JsonDocument {
+    Json *root;
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    size_t memory;             /* bytes held by the tree, 0 until loaded */
+    atomic_size_t refs;        /* the table holds one while cached */
+    atomic_uint_fast64_t used; /* tick of the last lookup */
+    atomic_bool loading;
+    bool failed;
+    bool cached; /* still in the table, guarded by the table lock */
+};
+
+typedef struct {
+    JsonDocument **arr;
+    size_t n;
+    size_t capacity;
+    size_t memory;
+    size_t budget;
+    atomic_uint_fast64_t tick;
+    pthread_rwlock_t lock;
+    pthread_mutex_t load_lock;
+    pthread_cond_t loaded;
+} Cache;
+
+static Cache cache = {.budget = JSON_CACHE_DEFAULT_BUDGET,
+                      .lock = PTHREAD_RWLOCK_INITIALIZER,
+                      .load_lock = PTHREAD_MUTEX_INITIALIZER,
+                      .loaded = PTHREAD_COND_INITIALIZER};
+
+// bytes allocated for the tree, approximately
+static size_t json_memory(Json *json) {
+    size_t n = sizeof(Json);
+
+    switch (json->type) {
+    case JSON_OBJECT:
+        n += sizeof(JsonObjectMember) * json->value.object.capacity;
+        for (size_t i = 0; i < json->value.object.n; i++) {
+            n += strlen(json->value.object.arr[i].key) + 1;
+            n += json_memory(json->value.object.arr[i].value);
+        }
+        break;
+    case JSON_ARRAY:
+        if (json->value.array.storage != JSON_ARRAY_BOXED) {
+            n += sizeof(int64_t) * json->value.array.capacity;
+            break;
+        }
+        n += sizeof(Json *) * json->value.array.capacity;
+        for (size_t i = 0; i < json->value.array.n; i++)
+            n += json_memory(json->value.array.arr[i]);
+        break;
+    case JSON_STRING:
+        n += strlen(json->value.string) + 1;
+        break;
+    case JSON_NUMBER:
+        n += strlen(json->value.number.value) + 1;
+        break;
+    case JSON_BOOLEAN:
+    case JSON_NULL_VALUE:
+        break;
+    }
+    return n;
+}
+
+static bool same_file(JsonDocument *document, struct stat *st) {
+    return document->dev == st->st_dev && document->ino == st->st_ino &&
+           document->size == st->st_size &&
+           document->mtime.tv_sec == st->st_mtim.tv_sec &&
+           document->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// table lock held
+static JsonDocument *cache_find(const char *path) {
+    for (size_t i = 0; i < cache.n; i++) {
+        if (strcmp(cache.arr[i]->path, path) == 0)
+            return cache.arr[i];
+    }
+    return NULL;
+}
+
+static void document_retain(JsonDocument *document) {
+    atomic_fetch_add(&document->refs, 1);
+    atomic_store(&document->used, atomic_fetch_add(&cache.tick, 1));
+}
+
+// exclusive table lock held. drops the table's reference, readers holding
+// the document keep it alive
+static void cache_remove(size_t i) {
+    JsonDocument *document = cache.arr[i];
+
+    cache.arr[i] = cache.arr[--cache.n];
+    cache.memory -= document->memory;
+    document->cached = false;
+    json_document_release(&document);
+}
+
+// exclusive table lock held
+static void cache_evict(void) {
+    while (cache.memory > cache.budget) {
+        size_t victim = cache.n;
+        uint_fast64_t oldest = UINT_FAST64_MAX;
+
+        for (size_t i = 0; i < cache.n; i++) {
+            JsonDocument *document = cache.arr[i];
+            uint_fast64_t used = atomic_load(&document->used);
+            if (!atomic_load(&document->loading) && used < oldest) {
+                oldest = used;
+                victim = i;
+            }
+        }
+
+        if (victim == cache.n)
+            break;
+        cache_remove(victim);
+    }
+}
+
+// exclusive table lock held. the entry starts with a reference for the
+// table and one for the caller
+static JsonDocument *cache_insert(const char *path, struct stat *st) {
+    JsonDocument *document = (JsonDocument *)calloc(1, sizeof(JsonDocument));
+    if (document == NULL) {
+        LOG_ERROR("failed to allocate memory for document: %s",
+                  strerror(errno));
+        return NULL;
+    }
+
+    if (cache.n == cache.capacity) {
+        size_t capacity = cache.capacity == 0 ? 8 : cache.capacity * 2;
+        JsonDocument **arr = (JsonDocument **)realloc(
+            cache.arr, sizeof(JsonDocument *) * capacity);
+        if (arr == NULL) {
+            LOG_ERROR("failed to allocate memory for cache: %s",
+                      strerror(errno));
+            free(document);
+            return NULL;
+        }
+        cache.arr = arr;
+        cache.capacity = capacity;
+    }
+
+    document->path = strdup(path);
+    document->dev = st->st_dev;
+    document->ino = st->st_ino;
+    document->size = st->st_size;
+    document->mtime = st->st_mtim;
+    atomic_init(&document->refs, 2);
+    atomic_init(&document->used, atomic_fetch_add(&cache.tick, 1));
+    atomic_init(&document->loading, true);
+    document->cached = true;
+
+    cache.arr[cache.n++] = document;
+    return document;
+}
+
+// parses from the descriptor that was fstat'ed for the cache key, so the
+// tree matches the identity it is cached under
+static void document_load(JsonDocument *document, int fd) {
+    Json *root = NULL;
+    Source *source = source_from_fd(fd, document->path);
+    if (source != NULL) {
+        root = json_parse_source(source);
+        source_close(&source);
+    }
+
+    // hashes are cached in the nodes on first use, computing them now keeps
+    // the shared tree from being written to afterwards
+    if (root != NULL)
+        json_hash(root);
+
+    size_t memory = root != NULL ? json_memory(root) : 0;
+
+    pthread_mutex_lock(&cache.load_lock);
+    document->root = root;
+    document->failed = root == NULL;
+    atomic_store(&document->loading, false);
+    pthread_cond_broadcast(&cache.loaded);
+    pthread_mutex_unlock(&cache.load_lock);
+
+    pthread_rwlock_wrlock(&cache.lock);
+    if (document->cached && root == NULL) {
+        // failures aren't cached, the next request tries again
+        for (size_t i = 0; i < cache.n; i++) {
+            if (cache.arr[i] == document) {
+                cache_remove(i);
+                break;
+            }
+        }
+    } else if (document->cached) {
+        document->memory = memory;
+        cache.memory += memory;
+        cache_evict();
+    }
+    pthread_rwlock_unlock(&cache.lock);
+}
+
+// waits for a parse started by another caller, whose result is shared
+static JsonDocument *document_wait(JsonDocument *document) {
+    if (atomic_load(&document->loading)) {
+        pthread_mutex_lock(&cache.load_lock);
+        while (atomic_load(&document->loading))
+            pthread_cond_wait(&cache.loaded, &cache.load_lock);
+        pthread_mutex_unlock(&cache.load_lock);
+    }
+
+    if (document->failed) {
+        json_document_release(&document);
+        return NULL;
+    }
+    return document;
+}
+
+JsonDocument *json_parse_cached(const char *filepath) {
+    assert(filepath != NULL);
+
+    // a hit only stats the path. a stat that fails here fails the open
+    // below too, which reports it
+    struct stat st;
+    if (stat(filepath, &st) == 0) {
+        pthread_rwlock_rdlock(&cache.lock);
+        JsonDocument *document = cache_find(filepath);
+        if (document != NULL && same_file(document, &st)) {
+            document_retain(document);
+            pthread_rwlock_unlock(&cache.lock);
+            return document_wait(document);
+        }
+        pthread_rwlock_unlock(&cache.lock);
+    }
+
+    // on a miss the entry is keyed by the identity of the descriptor that
+    // is parsed, a rename after the stat can't pair one version's identity
+    // with another's contents
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) {
+        LOG_ERROR("failed to open file: %s", strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        LOG_ERROR("failed to stat %s: %s", filepath, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    pthread_rwlock_wrlock(&cache.lock);
+    // another caller may have got here first
+    JsonDocument *document = cache_find(filepath);
+    if (document != NULL && same_file(document, &st)) {
+        document_retain(document);
+        pthread_rwlock_unlock(&cache.lock);
+        close(fd);
+        return document_wait(document);
+    }
+
+    // the file changed, the stale version goes once its readers are done
+    for (size_t i = 0; document != NULL && i < cache.n; i++) {
+        if (cache.arr[i] == document) {
+            cache_remove(i);
+            break;
+        }
+    }
+
+    document = cache_insert(filepath, &st);
+    pthread_rwlock_unlock(&cache.lock);
+    if (document == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    document_load(document, fd);
+    close(fd);
+    if (document->failed) {
+        json_document_release(&document);
+        return NULL;
+    }
+    return document;
+}
+
+Json *json_document_root(JsonDocument *document) {
+    assert(document != NULL);
+    return document->root;
+}
+
+void json_document_release(JsonDocument **document_ptr) {
+    assert(document_ptr != NULL && *document_ptr != NULL);
+
+    JsonDocument *document = *document_ptr;
+    *document_ptr = NULL;
+
+    if (atomic_fetch_sub(&document->refs, 1) != 1)
+        return;
+
+    json_free(&document->root);
+    free(document->path);
+    free(document);
+}
+
+void json_cache_set_budget(size_t budget) {
+    pthread_rwlock_wrlock(&cache.lock);
+    cache.budget = budget;
+    cache_evict();
+    pthread_rwlock_unlock(&cache.lock);
+}
+
+// drops every cached document, documents still held stay valid
+void json_cache_clear(void) {
+    pthread_rwlock_wrlock(&cache.lock);
+    while (cache.n > 0)
+        cache_remove(cache.n - 1);
+    pthread_rwlock_unlock(&cache.lock);
+}
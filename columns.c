@@ -0,0 +1,510 @@
+#include "json.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "lexer.h"
+
+#define COLUMN_INITIAL_CAPACITY 64
+
+// numbers are converted from a nul terminated copy of the lexeme, made on
+// the stack unless the lexeme is longer than this
+#define COLUMN_NUMBER_LENGTH 64
+
+#define BIT_GET(bitmap, i) (((bitmap)[(i) >> 3] >> ((i)&7)) & 1)
+#define BIT_SET(bitmap, i) ((bitmap)[(i) >> 3] |= (uint8_t)(1 << ((i)&7)))
+
+static size_t bitmap_size(size_t bits) { return (bits + 7) / 8; }
+
+// grows a buffer of old_size bytes to new_size, zeroing the new part
+static void *grow_zeroed(void *buf, size_t old_size, size_t new_size) {
+    char *grown = (char *)realloc(buf, new_size);
+    if (grown != NULL)
+        memset(grown + old_size, 0, new_size - old_size);
+    return grown;
+}
+
+// allocates the typed storage of a column once its type is known
+static void column_alloc_data(JsonColumn *column) {
+    size_t capacity = column->capacity;
+
+    switch (column->type) {
+    case JSON_COLUMN_INT:
+    case JSON_COLUMN_DOUBLE:
+        column->data.ints = (int64_t *)calloc(capacity, sizeof(int64_t));
+        break;
+    case JSON_COLUMN_BOOLEAN:
+        column->data.booleans = (uint8_t *)calloc(bitmap_size(capacity), 1);
+        break;
+    case JSON_COLUMN_STRING:
+        column->data.bytes = NULL;
+        break;
+    case JSON_COLUMN_EMPTY:
+        break;
+    }
+}
+
+// makes room for rows up to and including row
+static void column_reserve(JsonColumn *column, size_t row) {
+    if (row < column->capacity)
+        return;
+
+    size_t old = column->capacity;
+    size_t capacity = old == 0 ? COLUMN_INITIAL_CAPACITY : old * 2;
+    while (capacity <= row)
+        capacity *= 2;
+
+    column->valid = (uint8_t *)grow_zeroed(column->valid, bitmap_size(old),
+                                           bitmap_size(capacity));
+    // offsets are kept for every column so a late string type needs no fixup
+    column->offsets = (size_t *)grow_zeroed(
+        column->offsets, old == 0 ? 0 : sizeof(size_t) * (old + 1),
+        sizeof(size_t) * (capacity + 1));
+
+    switch (column->type) {
+    case JSON_COLUMN_INT:
+    case JSON_COLUMN_DOUBLE:
+        column->data.ints = (int64_t *)grow_zeroed(
+            column->data.ints, sizeof(int64_t) * old, sizeof(int64_t) * capacity);
+        break;
+    case JSON_COLUMN_BOOLEAN:
+        column->data.booleans = (uint8_t *)grow_zeroed(
+            column->data.booleans, bitmap_size(old), bitmap_size(capacity));
+        break;
+    case JSON_COLUMN_STRING:
+    case JSON_COLUMN_EMPTY:
+        break;
+    }
+
+    column->capacity = capacity;
+}
+
+// a value to append, taken from a tree node or straight from a token
+typedef struct {
+    JsonType type; /* JSON_NULL_VALUE for null and missing values */
+    JsonNumberType number_type;
+    bool boolean;
+    const char *ptr; /* strings and numbers, not nul terminated */
+    size_t len;
+} ColumnValue;
+
+static const ColumnValue column_null = {.type = JSON_NULL_VALUE};
+
+static JsonColumnType column_type_of(const ColumnValue *value) {
+    switch (value->type) {
+    case JSON_NUMBER:
+        return value->number_type == JSON_NUMBER_INT ? JSON_COLUMN_INT
+                                                     : JSON_COLUMN_DOUBLE;
+    case JSON_BOOLEAN:
+        return JSON_COLUMN_BOOLEAN;
+    case JSON_STRING:
+        return JSON_COLUMN_STRING;
+    default:
+        return JSON_COLUMN_EMPTY;
+    }
+}
+
+// widens an int column to double in place, both are 8 bytes wide
+static void column_promote_to_double(JsonColumn *column, size_t rows) {
+    for (size_t i = 0; i < rows; i++) {
+        int64_t n;
+        memcpy(&n, &column->data.ints[i], sizeof(n));
+        double d = (double)n;
+        memcpy(&column->data.ints[i], &d, sizeof(d));
+    }
+    column->type = JSON_COLUMN_DOUBLE;
+}
+
+static void column_append_bytes(JsonColumn *column, const char *str,
+                                size_t len) {
+    if (column->bytes_len + len > column->bytes_capacity) {
+        size_t capacity = column->bytes_capacity == 0
+                              ? COLUMN_INITIAL_CAPACITY
+                              : column->bytes_capacity;
+        while (capacity < column->bytes_len + len)
+            capacity *= 2;
+        column->data.bytes = (char *)realloc(column->data.bytes, capacity);
+        column->bytes_capacity = capacity;
+    }
+
+    memcpy(column->data.bytes + column->bytes_len, str, len);
+    column->bytes_len += len;
+}
+
+// stores a number lexeme in an int or double column, false when it couldn't
+// be converted
+static bool column_store_number(JsonColumn *column, size_t row,
+                                const ColumnValue *value) {
+    char buf[COLUMN_NUMBER_LENGTH];
+    char *number = buf;
+
+    if (value->len < sizeof(buf)) {
+        memcpy(buf, value->ptr, value->len);
+        buf[value->len] = 0;
+    } else if ((number = strndup(value->ptr, value->len)) == NULL) {
+        LOG_ERROR("failed to allocate memory for number: %s", strerror(errno));
+        return false;
+    }
+
+    if (column->type == JSON_COLUMN_INT)
+        column->data.ints[row] = strtoll(number, NULL, 10);
+    else
+        column->data.doubles[row] = strtod(number, NULL);
+
+    if (number != buf)
+        free(number);
+    return true;
+}
+
+// appends the next row to the column. null, missing (JSON_NULL_VALUE) and
+// values that don't fit the column's type are stored as null
+static void column_append(JsonColumn *column, const ColumnValue *value) {
+    size_t row = column->n++;
+    column_reserve(column, row);
+
+    JsonColumnType value_type = column_type_of(value);
+
+    if (value->type != JSON_NULL_VALUE && value_type == JSON_COLUMN_EMPTY) {
+        // nested objects and arrays have no columnar representation
+        column->mismatched++;
+    } else if (value_type != JSON_COLUMN_EMPTY) {
+        if (column->type == JSON_COLUMN_EMPTY) {
+            column->type = value_type;
+            column_alloc_data(column);
+        } else if (column->type == JSON_COLUMN_INT &&
+                   value_type == JSON_COLUMN_DOUBLE) {
+            column_promote_to_double(column, row);
+        }
+
+        bool fits = column->type == value_type ||
+                    (column->type == JSON_COLUMN_DOUBLE &&
+                     value_type == JSON_COLUMN_INT);
+
+        bool stored = fits;
+
+        switch (fits ? column->type : JSON_COLUMN_EMPTY) {
+        case JSON_COLUMN_INT:
+        case JSON_COLUMN_DOUBLE:
+            stored = column_store_number(column, row, value);
+            break;
+        case JSON_COLUMN_BOOLEAN:
+            if (value->boolean)
+                BIT_SET(column->data.booleans, row);
+            break;
+        case JSON_COLUMN_STRING:
+            column_append_bytes(column, value->ptr, value->len);
+            break;
+        case JSON_COLUMN_EMPTY:
+            break;
+        }
+
+        if (stored)
+            BIT_SET(column->valid, row);
+        else
+            column->mismatched++;
+    }
+
+    column->offsets[row + 1] = column->bytes_len;
+}
+
+static JsonColumns *columns_new(const char **fields, size_t n_fields) {
+    JsonColumns *columns = (JsonColumns *)malloc(sizeof(JsonColumns));
+    if (columns == NULL) {
+        LOG_ERROR("failed to allocate memory for columns: %s", strerror(errno));
+        return NULL;
+    }
+
+    columns->arr = (JsonColumn *)calloc(n_fields, sizeof(JsonColumn));
+    if (columns->arr == NULL && n_fields > 0) {
+        LOG_ERROR("failed to allocate memory for columns: %s", strerror(errno));
+        free(columns);
+        return NULL;
+    }
+
+    columns->n = n_fields;
+    columns->rows = 0;
+    for (size_t i = 0; i < n_fields; i++) {
+        columns->arr[i].name = strdup(fields[i]);
+        columns->arr[i].type = JSON_COLUMN_EMPTY;
+    }
+    return columns;
+}
+
+void json_columns_free(JsonColumns **columns_ptr) {
+    assert(columns_ptr != NULL && *columns_ptr != NULL);
+
+    JsonColumns *columns = *columns_ptr;
+    for (size_t i = 0; i < columns->n; i++) {
+        JsonColumn *column = &columns->arr[i];
+        free((char *)column->name);
+        free(column->valid);
+        free(column->offsets);
+        // every member of the union is a single allocation
+        free(column->data.ints);
+    }
+    free(columns->arr);
+    free(columns);
+    *columns_ptr = NULL;
+}
+
+// returns whether row holds a value, as opposed to null or missing
+bool json_column_valid(const JsonColumn *column, size_t row) {
+    assert(row < column->n);
+    return BIT_GET(column->valid, row);
+}
+
+bool json_column_boolean(const JsonColumn *column, size_t row) {
+    assert(column->type == JSON_COLUMN_BOOLEAN && row < column->n);
+    return BIT_GET(column->data.booleans, row);
+}
+
+// returns the bytes of a string row, which are not NUL terminated
+const char *json_column_string(const JsonColumn *column, size_t row,
+                               size_t *len) {
+    assert(column->type == JSON_COLUMN_STRING && row < column->n);
+    *len = column->offsets[row + 1] - column->offsets[row];
+    return column->data.bytes + column->offsets[row];
+}
+
+static ColumnValue node_value(Json *json) {
+    ColumnValue value = {.type = json->type};
+
+    switch (json->type) {
+    case JSON_STRING:
+        value.ptr = json->value.string;
+        value.len = strlen(value.ptr);
+        break;
+    case JSON_NUMBER:
+        value.number_type = json->value.number.type;
+        value.ptr = json->value.number.value;
+        value.len = strlen(value.ptr);
+        break;
+    case JSON_BOOLEAN:
+        value.boolean = json->value.boolean;
+        break;
+    default:
+        break;
+    }
+    return value;
+}
+
+// projects the given fields of an array of objects into typed columns.
+// elements that are not objects become rows of nulls
+JsonColumns *json_to_columns(Json *array, const char **fields,
+                             size_t n_fields) {
+    assert(array != NULL);
+
+    if (array->type != JSON_ARRAY) {
+        LOG_ERROR("json_to_columns: expected an array");
+        return NULL;
+    }
+
+    JsonColumns *columns = columns_new(fields, n_fields);
+    if (columns == NULL)
+        return NULL;
+
+    // packed arrays hold only numbers, so every row is null
+    JsonArray *records = &array->value.array;
+    bool packed = records->storage != JSON_ARRAY_BOXED;
+
+    for (size_t row = 0; row < records->n; row++) {
+        Json *record = packed ? NULL : records->arr[row];
+
+        for (size_t i = 0; i < n_fields; i++) {
+            Json *value = NULL;
+            if (record != NULL && record->type == JSON_OBJECT) {
+                JsonObject *object = &record->value.object;
+                for (size_t j = 0; j < object->n; j++) {
+                    if (strcmp(object->arr[j].key, fields[i]) == 0) {
+                        value = object->arr[j].value;
+                        break;
+                    }
+                }
+            }
+
+            ColumnValue cell = value != NULL ? node_value(value) : column_null;
+            column_append(&columns->arr[i], &cell);
+        }
+    }
+
+    columns->rows = records->n;
+    return columns;
+}
+
+/* ------------------------ direct from the lexer ------------------------ */
+
+static bool token_is_scalar(Token token) {
+    return token.type == TOK_STRING || token.type == TOK_NUMBER_INT ||
+           token.type == TOK_NUMBER_FLOAT || token.type == TOK_TRUE ||
+           token.type == TOK_FALSE || token.type == TOK_NULL;
+}
+
+static void token_error(Lexer *lexer, Token token, const char *expected) {
+    LOG_ERROR_AT(lexer, token.offset, "expected %s but got %s", expected,
+                 get_token_name(token));
+}
+
+// the lexeme of a scalar token is only viewed, it stays valid until the
+// next token is read
+static ColumnValue token_value(Token token) {
+    ColumnValue value = {.type = JSON_NULL_VALUE};
+
+    switch (token.type) {
+    case TOK_STRING:
+        value.type = JSON_STRING;
+        value.ptr = token.ptr;
+        value.len = token.len;
+        break;
+    case TOK_NUMBER_INT:
+    case TOK_NUMBER_FLOAT:
+        value.type = JSON_NUMBER;
+        value.number_type = token.type == TOK_NUMBER_INT ? JSON_NUMBER_INT
+                                                         : JSON_NUMBER_FLOAT;
+        value.ptr = token.ptr;
+        value.len = token.len;
+        break;
+    case TOK_TRUE:
+    case TOK_FALSE:
+        value.type = JSON_BOOLEAN;
+        value.boolean = token.type == TOK_TRUE;
+        break;
+    default:
+        break;
+    }
+    return value;
+}
+
+static bool key_matches(const char *name, Token key) {
+    return strncmp(name, key.ptr, key.len) == 0 && name[key.len] == 0;
+}
+
+// state of each column while a record is parsed
+enum { FIELD_UNSEEN, FIELD_SEEN, FIELD_CURRENT };
+
+// parses one object of the array into the next row, the opening brace has
+// been read. tokens are only viewed, nothing is allocated per key or value
+static bool parse_record(Lexer *lexer, JsonColumns *columns, uint8_t *state) {
+    memset(state, FIELD_UNSEEN, columns->n);
+
+    Token token = lexer_view_token(lexer);
+
+    while (token.type != TOK_OBJECT_END) {
+        if (token.type != TOK_STRING) {
+            token_error(lexer, token, "key");
+            return false;
+        }
+
+        // a field requested twice fills every column of that name, only the
+        // first occurrence of a key in the record counts. the key is matched
+        // now, its lexeme is gone once the value is read
+        bool matched = false;
+        for (size_t i = 0; i < columns->n; i++) {
+            if (state[i] == FIELD_UNSEEN &&
+                key_matches(columns->arr[i].name, token)) {
+                state[i] = FIELD_CURRENT;
+                matched = true;
+            }
+        }
+
+        token = lexer_view_token(lexer);
+        if (token.type != TOK_COLON) {
+            token_error(lexer, token, "colon (:)");
+            return false;
+        }
+
+        token = lexer_view_token(lexer);
+        bool scalar = token_is_scalar(token);
+        ColumnValue value = token_value(token);
+        for (size_t i = 0; matched && i < columns->n; i++) {
+            JsonColumn *column = &columns->arr[i];
+            if (state[i] != FIELD_CURRENT)
+                continue;
+            state[i] = FIELD_SEEN;
+            if (scalar) {
+                column_append(column, &value);
+            } else {
+                column_append(column, &column_null);
+                column->mismatched++;
+            }
+        }
+
+        if (!scalar && !lexer_skip_value(lexer, token))
+            return false;
+
+        token = lexer_view_token(lexer);
+        if (token.type == TOK_OBJECT_END)
+            break;
+        if (token.type != TOK_COMMA) {
+            token_error(lexer, token, "comma");
+            return false;
+        }
+        token = lexer_view_token(lexer);
+    }
+
+    for (size_t i = 0; i < columns->n; i++) {
+        if (state[i] == FIELD_UNSEEN)
+            column_append(&columns->arr[i], &column_null);
+    }
+    return true;
+}
+
+// like json_to_columns, but reads the array straight from the source without
+// building a json tree. fields that are not requested are skipped
+JsonColumns *json_parse_columns(Source *source, const char **fields,
+                                size_t n_fields) {
+    Lexer *lexer = lexer_init(source);
+    if (lexer == NULL) {
+        LOG_ERROR("failed to initialize lexer: %s", strerror(errno));
+        return NULL;
+    }
+
+    JsonColumns *columns = columns_new(fields, n_fields);
+    uint8_t *state = (uint8_t *)malloc(n_fields + 1);
+    bool ok = columns != NULL && state != NULL;
+
+    Token token = lexer_view_token(lexer);
+    if (ok && token.type != TOK_ARRAY_START) {
+        token_error(lexer, token, "array");
+        ok = false;
+    }
+
+    if (ok)
+        token = lexer_view_token(lexer);
+
+    while (ok && token.type != TOK_ARRAY_END) {
+        if (token.type == TOK_OBJECT_START) {
+            ok = parse_record(lexer, columns, state);
+        } else if (token_is_scalar(token) || token.type == TOK_ARRAY_START) {
+            ok = lexer_skip_value(lexer, token);
+            for (size_t i = 0; i < n_fields; i++)
+                column_append(&columns->arr[i], &column_null);
+        } else {
+            token_error(lexer, token, "value");
+            ok = false;
+        }
+
+        if (!ok)
+            break;
+        columns->rows++;
+
+        token = lexer_view_token(lexer);
+        if (token.type == TOK_ARRAY_END)
+            break;
+        if (token.type != TOK_COMMA) {
+            token_error(lexer, token, "comma");
+            ok = false;
+            break;
+        }
+        token = lexer_view_token(lexer);
+    }
+
+    free(state);
+    lexer_free(&lexer);
+
+    if (!ok && columns != NULL)
+        json_columns_free(&columns);
+    return columns;
+}
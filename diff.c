@@ -0,0 +1,410 @@
+#include "json.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+// defined in print.c
+void __json_print(FILE *fp, Json *root, int current_indent, int indent_step);
+
+static uint64_t hash_bytes(uint64_t h, const char *data, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        h ^= (unsigned char)data[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+// splitmix64 finalizer, spreads every input bit over the whole hash
+static uint64_t hash_mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static uint64_t hash_double(double d) {
+    uint64_t bits;
+
+    // -0 and 0 compare equal, so they must hash the same
+    if (d == 0)
+        d = 0;
+    memcpy(&bits, &d, sizeof(bits));
+    return bits;
+}
+
+// 2^63 as a double, the first value past the int64_t range
+#define INT64_LIMIT 9223372036854775808.0
+
+// true when d holds exactly the integer i. ints and floats only compare equal
+// in that case, which keeps equality consistent with hash_int
+static bool int_is_double(int64_t i, double d) {
+    return (double)i == d && d >= -INT64_LIMIT && d < INT64_LIMIT &&
+           (int64_t)d == i;
+}
+
+// ints a double holds exactly hash like that double, so that 1 and 1.0 match.
+// the others hash by value, rounding them would make neighbours collide
+static uint64_t hash_int(int64_t i) {
+    if (int_is_double(i, (double)i))
+        return hash_double((double)i);
+    return hash_mix((uint64_t)i ^ FNV_OFFSET_BASIS);
+}
+
+static uint64_t hash_number(JsonNumber number) {
+    if (number.type == JSON_NUMBER_INT)
+        return hash_int(json_number_int(number));
+    return hash_double(json_number_double(number));
+}
+
+// hash of element i of a packed array, the same as json_hash gives its
+// boxed node
+uint64_t __json_packed_hash(const JsonArray *array, size_t i) {
+    uint64_t number = array->storage == JSON_ARRAY_INTS
+                          ? hash_int(array->packed.ints[i])
+                          : hash_double(array->packed.doubles[i]);
+    uint64_t h = hash_mix(hash_mix(JSON_NUMBER + 1) ^ number);
+    return h == 0 ? 1 : h;
+}
+
+static uint64_t hash_element(JsonArray *array, size_t i) {
+    if (array->storage == JSON_ARRAY_BOXED)
+        return json_hash(array->arr[i]);
+    return __json_packed_hash(array, i);
+}
+
+// returns the content hash of the node, computing it bottom-up on first use
+// and caching it in every node visited. objects hash independently of member
+// order.
+uint64_t json_hash(Json *json) {
+    assert(json != NULL);
+
+    if (json->hash != 0)
+        return json->hash;
+
+    uint64_t h = hash_mix(json->type + 1);
+
+    switch (json->type) {
+    case JSON_OBJECT: {
+        uint64_t members = 0;
+        for (size_t i = 0; i < json->value.object.n; i++) {
+            JsonObjectMember *member = &json->value.object.arr[i];
+            uint64_t key = hash_bytes(FNV_OFFSET_BASIS, member->key,
+                                      strlen(member->key));
+            members += hash_mix(key ^ hash_mix(json_hash(member->value)));
+        }
+        h = hash_mix(h ^ members);
+        break;
+    }
+    case JSON_ARRAY:
+        for (size_t i = 0; i < json->value.array.n; i++)
+            h = hash_mix(h * FNV_PRIME + hash_element(&json->value.array, i));
+        break;
+    case JSON_STRING:
+        h = hash_bytes(h, json->value.string, strlen(json->value.string));
+        break;
+    case JSON_BOOLEAN:
+        h = hash_mix(h ^ (json->value.boolean + 1));
+        break;
+    case JSON_NUMBER:
+        h = hash_mix(h ^ hash_number(json->value.number));
+        break;
+    case JSON_NULL_VALUE:
+        break;
+    }
+
+    // 0 marks a hash that has not been computed yet
+    if (h == 0)
+        h = 1;
+
+    return json->hash = h;
+}
+
+// finds key in object, checking the member at hint first since successive
+// snapshots tend to keep members in the same order
+static Json *object_find(JsonObject *object, const char *key, size_t hint) {
+    if (hint < object->n && strcmp(object->arr[hint].key, key) == 0)
+        return object->arr[hint].value;
+
+    for (size_t i = 0; i < object->n; i++) {
+        if (strcmp(object->arr[i].key, key) == 0)
+            return object->arr[i].value;
+    }
+    return NULL;
+}
+
+static bool numbers_equal(JsonNumber a, JsonNumber b) {
+    if (a.type == JSON_NUMBER_INT && b.type == JSON_NUMBER_INT)
+        return json_number_int(a) == json_number_int(b);
+    if (a.type == JSON_NUMBER_INT)
+        return int_is_double(json_number_int(a), json_number_double(b));
+    if (b.type == JSON_NUMBER_INT)
+        return int_is_double(json_number_int(b), json_number_double(a));
+    return json_number_double(a) == json_number_double(b);
+}
+
+// reads element i as a number, false when it is some other kind of value
+static bool element_number(JsonArray *array, size_t i, JsonNumber *boxed,
+                           bool *is_int, int64_t *int_value,
+                           double *double_value) {
+    if (array->storage == JSON_ARRAY_INTS) {
+        *is_int = true;
+        *int_value = array->packed.ints[i];
+        *double_value = (double)*int_value;
+        return true;
+    }
+    if (array->storage == JSON_ARRAY_DOUBLES) {
+        *is_int = false;
+        *double_value = array->packed.doubles[i];
+        return true;
+    }
+
+    Json *node = array->arr[i];
+    if (node->type != JSON_NUMBER)
+        return false;
+    *boxed = node->value.number;
+    *is_int = boxed->type == JSON_NUMBER_INT;
+    if (*is_int)
+        *int_value = json_number_int(*boxed);
+    *double_value = json_number_double(*boxed);
+    return true;
+}
+
+static bool elements_equal(JsonArray *aa, JsonArray *ab, size_t i) {
+    if (aa->storage == JSON_ARRAY_BOXED && ab->storage == JSON_ARRAY_BOXED)
+        return json_equal(aa->arr[i], ab->arr[i]);
+
+    JsonNumber na, nb;
+    bool int_a, int_b;
+    int64_t ia = 0, ib = 0;
+    double da, db;
+
+    if (!element_number(aa, i, &na, &int_a, &ia, &da) ||
+        !element_number(ab, i, &nb, &int_b, &ib, &db))
+        return false;
+    if (int_a && int_b)
+        return ia == ib;
+    if (int_a)
+        return int_is_double(ia, db);
+    if (int_b)
+        return int_is_double(ib, da);
+    return da == db;
+}
+
+// deep comparison, subtrees whose cached hashes differ are rejected without
+// being visited
+bool json_equal(Json *a, Json *b) {
+    if (a == b)
+        return true;
+
+    if (a == NULL || b == NULL || a->type != b->type ||
+        json_hash(a) != json_hash(b))
+        return false;
+
+    switch (a->type) {
+    case JSON_OBJECT: {
+        JsonObject *oa = &a->value.object, *ob = &b->value.object;
+        if (oa->n != ob->n)
+            return false;
+        for (size_t i = 0; i < oa->n; i++) {
+            Json *value = object_find(ob, oa->arr[i].key, i);
+            if (value == NULL || !json_equal(oa->arr[i].value, value))
+                return false;
+        }
+        return true;
+    }
+    case JSON_ARRAY: {
+        JsonArray *aa = &a->value.array, *ab = &b->value.array;
+        if (aa->n != ab->n)
+            return false;
+        for (size_t i = 0; i < aa->n; i++) {
+            if (!elements_equal(aa, ab, i))
+                return false;
+        }
+        return true;
+    }
+    case JSON_STRING:
+        return strcmp(a->value.string, b->value.string) == 0;
+    case JSON_BOOLEAN:
+        return a->value.boolean == b->value.boolean;
+    case JSON_NUMBER:
+        return numbers_equal(a->value.number, b->value.number);
+    case JSON_NULL_VALUE:
+        return true;
+    }
+    return false;
+}
+
+static void diff_push(JsonDiff *diff, JsonDiffOp op, String *path,
+                      Json *value) {
+    if (diff->n == diff->capacity) {
+        diff->capacity += 16;
+        diff->arr = (JsonDiffEntry *)realloc(
+            diff->arr, sizeof(JsonDiffEntry) * diff->capacity);
+    }
+
+    diff->arr[diff->n++] =
+        (JsonDiffEntry){.op = op, .path = strdup(path->buf), .value = value};
+}
+
+// appends a json pointer reference token, escaping ~ and /
+static void path_push_key(String *path, const char *key) {
+    APPEND_STRING((*path), '/');
+    for (const char *c = key; *c; c++) {
+        if (*c == '~' || *c == '/') {
+            APPEND_STRING((*path), '~');
+            APPEND_STRING((*path), *c == '~' ? '0' : '1');
+        } else {
+            APPEND_STRING((*path), *c);
+        }
+    }
+}
+
+static void path_push_index(String *path, size_t index) {
+    char token[24];
+    snprintf(token, sizeof(token), "/%zu", index);
+    for (char *c = token; *c; c++)
+        APPEND_STRING((*path), *c);
+}
+
+static void path_truncate(String *path, size_t n) {
+    path->n = n;
+    path->buf[n] = 0;
+}
+
+static void diff_node(JsonDiff *diff, String *path, Json *a, Json *b) {
+    // identical subtrees are skipped without being visited. leaves are cheap
+    // to compare, so a hash collision between them is never mistaken for
+    // equality
+    if (a == b)
+        return;
+    if (json_hash(a) == json_hash(b) &&
+        (a->type == JSON_OBJECT || a->type == JSON_ARRAY || json_equal(a, b)))
+        return;
+
+    if (a->type != b->type ||
+        (a->type != JSON_OBJECT && a->type != JSON_ARRAY)) {
+        diff_push(diff, JSON_DIFF_REPLACE, path, b);
+        return;
+    }
+
+    size_t mark = path->n;
+
+    if (a->type == JSON_OBJECT) {
+        JsonObject *oa = &a->value.object, *ob = &b->value.object;
+
+        for (size_t i = 0; i < oa->n; i++) {
+            Json *value = object_find(ob, oa->arr[i].key, i);
+            path_push_key(path, oa->arr[i].key);
+            if (value == NULL)
+                diff_push(diff, JSON_DIFF_REMOVE, path, NULL);
+            else
+                diff_node(diff, path, oa->arr[i].value, value);
+            path_truncate(path, mark);
+        }
+
+        for (size_t i = 0; i < ob->n; i++) {
+            if (object_find(oa, ob->arr[i].key, i) != NULL)
+                continue;
+            path_push_key(path, ob->arr[i].key);
+            diff_push(diff, JSON_DIFF_ADD, path, ob->arr[i].value);
+            path_truncate(path, mark);
+        }
+        return;
+    }
+
+    // entries point at element nodes, so packed arrays are boxed first
+    Json **items_a = json_array_items(a), **items_b = json_array_items(b);
+    if (items_a == NULL || items_b == NULL)
+        return;
+
+    JsonArray *aa = &a->value.array, *ab = &b->value.array;
+    size_t common = aa->n < ab->n ? aa->n : ab->n;
+
+    for (size_t i = 0; i < common; i++) {
+        path_push_index(path, i);
+        diff_node(diff, path, items_a[i], items_b[i]);
+        path_truncate(path, mark);
+    }
+
+    for (size_t i = common; i < ab->n; i++) {
+        path_push_index(path, i);
+        diff_push(diff, JSON_DIFF_ADD, path, items_b[i]);
+        path_truncate(path, mark);
+    }
+
+    // remove from the end so that earlier indices stay valid when applied
+    for (size_t i = aa->n; i > common; i--) {
+        path_push_index(path, i - 1);
+        diff_push(diff, JSON_DIFF_REMOVE, path, NULL);
+        path_truncate(path, mark);
+    }
+}
+
+// lists the changes turning a into b. values in the diff point into b, which
+// must outlive it
+JsonDiff *json_diff(Json *a, Json *b) {
+    assert(a != NULL && b != NULL);
+
+    CREATE_ARRAY(JsonDiff, JsonDiffEntry, diff);
+    if (diff == NULL)
+        return NULL;
+
+    NEW_STRING(path);
+    path.buf[0] = 0;
+
+    diff_node(diff, &path, a, b);
+
+    FREE_STRING(path);
+    return diff;
+}
+
+void json_diff_free(JsonDiff **diff_ptr) {
+    assert(diff_ptr != NULL && *diff_ptr != NULL);
+
+    JsonDiff *diff = *diff_ptr;
+    for (size_t i = 0; i < diff->n; i++)
+        free(diff->arr[i].path);
+    FREE_ARRAY(diff);
+    *diff_ptr = NULL;
+}
+
+static const char *diff_op_name(JsonDiffOp op) {
+    switch (op) {
+    case JSON_DIFF_ADD:
+        return "add";
+    case JSON_DIFF_REMOVE:
+        return "remove";
+    case JSON_DIFF_REPLACE:
+        return "replace";
+    }
+    return NULL;
+}
+
+// prints the diff as a JSON Patch (RFC 6902) document
+void json_diff_fprint_patch(FILE *fp, JsonDiff *diff) {
+    assert(diff != NULL);
+
+    fputc('[', fp);
+    for (size_t i = 0; i < diff->n; i++) {
+        JsonDiffEntry *entry = &diff->arr[i];
+        if (i > 0)
+            fputc(',', fp);
+        fprintf(fp, "{\"op\":\"%s\",\"path\":\"%s\"", diff_op_name(entry->op),
+                entry->path);
+        if (entry->value != NULL) {
+            fputs(",\"value\":", fp);
+            __json_print(fp, entry->value, 0, 0);
+        }
+        fputc('}', fp);
+    }
+    fputs("]\n", fp);
+}
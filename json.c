@@ -4,6 +4,8 @@
 #include "lexer.h"
 #include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -16,10 +18,11 @@ typedef struct {
     Lexer *lexer;
     Token curr;
     ParserState state;
+    bool pack; /* pack arrays of numbers */
 } Parser;
 
-Parser *parser_init(const char *filepath) {
-    Lexer *lexer = lexer_init(filepath);
+Parser *parser_init(Source *source) {
+    Lexer *lexer = lexer_init(source);
     if (lexer == NULL) {
         LOG_ERROR("failed to initialize lexer: %s", strerror(errno));
         return NULL;
@@ -28,10 +31,13 @@ Parser *parser_init(const char *filepath) {
     Parser *parser = (Parser *)malloc(sizeof(Parser));
     if (parser == NULL) {
         LOG_ERROR("failed to allocated memory for parser: %s", strerror(errno));
+        lexer_free(&lexer);
         return NULL;
     }
 
     parser->lexer = lexer;
+    parser->state = PARSER_OK;
+    parser->pack = false;
     return parser;
 }
 
@@ -67,10 +73,12 @@ static void insert_into_object(JsonObject *object, const char *key,
     object->arr[object->n++] = (JsonObjectMember){.key = key, .value = value};
 }
 
-#define RETURN_JSON(node_type, selector, val)                                  \
+#define RETURN_JSON(node_type, selector, val, at)                              \
     {                                                                          \
         Json *json = (Json *)malloc(sizeof(Json));                             \
         json->type = node_type;                                                \
+        json->hash = 0;                                                        \
+        json->offset = at;                                                     \
         json->value.selector = val;                                            \
         return json;                                                           \
     }
@@ -84,7 +92,7 @@ static Json *node_value(Parser *parser) {
     Token token = parser->curr;
 
     if (token.type == TOK_STRING) {
-        RETURN_JSON(JSON_STRING, string, token.ptr);
+        RETURN_JSON(JSON_STRING, string, token.ptr, token.offset);
     }
 
     else if (token.type == TOK_NUMBER_INT || token.type == TOK_NUMBER_FLOAT) {
@@ -92,16 +100,19 @@ static Json *node_value(Parser *parser) {
                                                     ? JSON_NUMBER_INT
                                                     : JSON_NUMBER_FLOAT,
                                         .value = token.ptr};
-        RETURN_JSON(JSON_NUMBER, number, value);
+        RETURN_JSON(JSON_NUMBER, number, value, token.offset);
     }
 
     else if (token.type == TOK_TRUE || token.type == TOK_FALSE) {
-        RETURN_JSON(JSON_BOOLEAN, boolean, token.type == TOK_TRUE);
+        RETURN_JSON(JSON_BOOLEAN, boolean, token.type == TOK_TRUE,
+                    token.offset);
     }
 
     else if (token.type == TOK_NULL) {
         Json *json = (Json *)malloc(sizeof(Json));
         json->type = JSON_NULL_VALUE;
+        json->hash = 0;
+        json->offset = token.offset;
         return json;
     } else if (token.type == TOK_OBJECT_START) {
         return node_object(parser);
@@ -112,22 +123,131 @@ static Json *node_value(Parser *parser) {
     }
 
     else {
-        LOG_ERROR("parser error: invalid token %s", get_token_name(token));
+        LOG_ERROR_AT(parser->lexer, token.offset,
+                     "parser error: invalid token %s", get_token_name(token));
     }
 
     return NULL;
 }
 
+// defined in diff.c
+uint64_t __json_packed_hash(const JsonArray *array, size_t i);
+
+// formats element i of a packed array. doubles get the shortest form that
+// reads back exactly and keep a fraction so they still read as floats
+int __json_packed_format(const JsonArray *array, size_t i, char *buf,
+                         size_t n) {
+    if (array->storage == JSON_ARRAY_INTS)
+        return snprintf(buf, n, "%" PRId64, array->packed.ints[i]);
+
+    double d = array->packed.doubles[i];
+    int len = 0;
+    for (int precision = 15; precision <= 17; precision++) {
+        len = snprintf(buf, n, "%.*g", precision, d);
+        if (strtod(buf, NULL) == d)
+            break;
+    }
+    if (strcspn(buf, ".eE") == (size_t)len)
+        len += snprintf(buf + len, n - len, ".0");
+    return len;
+}
+
+// boxes the packed elements into nodes placed at offset, they have no
+// offsets of their own. the nodes are hashed before they are returned, so
+// that trees shared between threads aren't written once published
+static Json **array_box(JsonArray *array, size_t offset) {
+    size_t n = array->n > 0 ? array->n : 1;
+    Json **arr = (Json **)malloc(sizeof(Json *) * n);
+    if (arr == NULL) {
+        LOG_ERROR("failed to allocate memory for array: %s", strerror(errno));
+        return NULL;
+    }
+
+    JsonNumberType type = array->storage == JSON_ARRAY_INTS
+                              ? JSON_NUMBER_INT
+                              : JSON_NUMBER_FLOAT;
+    char buf[32];
+
+    for (size_t i = 0; i < array->n; i++) {
+        __json_packed_format(array, i, buf, sizeof(buf));
+
+        Json *json = (Json *)malloc(sizeof(Json));
+        json->type = JSON_NUMBER;
+        json->hash = __json_packed_hash(array, i);
+        json->offset = offset;
+        json->value.number = (JsonNumber){.type = type, .value = strdup(buf)};
+        arr[i] = json;
+    }
+    return arr;
+}
+
+// appends a number to a packed array, returns false when the array has to
+// be boxed instead. packed elements are printed from their values, so a
+// number is only packed when that gives back its lexeme: -0, 1e2 or 2.50
+// stay boxed, and so do arrays mixing ints and floats
+static bool pack_number(JsonArray *array, size_t *capacity, Token token) {
+    JsonArrayStorage storage;
+    if (token.type == TOK_NUMBER_INT)
+        storage = JSON_ARRAY_INTS;
+    else if (token.type == TOK_NUMBER_FLOAT)
+        storage = JSON_ARRAY_DOUBLES;
+    else
+        return false;
+
+    if (array->n > 0 && array->storage != storage)
+        return false;
+
+    if (array->n == *capacity) {
+        size_t grown = *capacity == 0 ? 16 : *capacity * 2;
+        void *packed = realloc(array->packed.ints, sizeof(int64_t) * grown);
+        if (packed == NULL)
+            return false;
+        array->packed.ints = (int64_t *)packed;
+        *capacity = grown;
+    }
+
+    errno = 0;
+    if (storage == JSON_ARRAY_INTS)
+        array->packed.ints[array->n] = strtoll(token.ptr, NULL, 10);
+    else
+        array->packed.doubles[array->n] = strtod(token.ptr, NULL);
+    if (errno == ERANGE)
+        return false;
+
+    JsonArrayStorage previous = array->storage;
+    array->storage = storage;
+
+    char buf[32];
+    int len = __json_packed_format(array, array->n, buf, sizeof(buf));
+    if ((size_t)len != token.len || memcmp(buf, token.ptr, len) != 0) {
+        array->storage = previous;
+        return false;
+    }
+
+    if (array->n == 0) {
+        free(array->arr);
+        array->arr = NULL;
+    }
+    array->n++;
+
+    free_token(token);
+    return true;
+}
+
 static Json *node_array(Parser *parser) {
     if (parser->state == PARSER_ERROR) {
         return NULL;
     }
 
     assert(parser->curr.type == TOK_ARRAY_START);
+    size_t start = parser->curr.offset;
 
     CREATE_ARRAY(JsonArray, Json *, array);
     if (array == NULL)
         return NULL;
+    array->storage = JSON_ARRAY_BOXED;
+    array->packed.ints = NULL;
+    size_t packed_capacity = 0;
 
     while (parser->state == PARSER_OK) {
         Token token = parser_get_token(parser);
@@ -138,9 +258,9 @@ static Json *node_array(Parser *parser) {
 
         if (array->n > 0 && token.type != TOK_COMMA) {
             parser->state = PARSER_ERROR;
-            LOG_ERROR("%s:%zu:%zu: Expected comma but got %s (\"%s\") instead",
-                      token.location.filepath, token.location.row,
-                      token.location.col, get_token_name(token), token.ptr);
+            LOG_ERROR_AT(parser->lexer, token.offset,
+                         "Expected comma but got %s (\"%s\") instead",
+                         get_token_name(token), token.ptr);
             break;
         }
 
@@ -148,6 +268,22 @@ static Json *node_array(Parser *parser) {
             token = parser_get_token(parser);
         }
 
+        if (parser->pack && pack_number(array, &packed_capacity, token))
+            continue;
+
+        if (array->storage != JSON_ARRAY_BOXED) {
+            // a value that doesn't fit, the elements so far become nodes
+            array->arr = array_box(array, start);
+            if (array->arr == NULL) {
+                parser->state = PARSER_ERROR;
+                break;
+            }
+            free(array->packed.ints);
+            array->packed.ints = NULL;
+            array->storage = JSON_ARRAY_BOXED;
+            array->capacity = array->n > 0 ? array->n : 1;
+        }
+
         Json *value = node_value(parser);
 
         if (value == NULL)
@@ -163,21 +299,35 @@ static Json *node_array(Parser *parser) {
     }
 
     if (parser->state == PARSER_ERROR) {
+        free(array->packed.ints);
         FREE_ARRAY(array);
         return NULL;
     }
 
     if (parser->curr.type != TOK_ARRAY_END) {
-        LOG_ERROR("Missing right bracket");
+        LOG_ERROR_AT(parser->lexer, parser->curr.offset,
+                     "Missing right bracket");
         parser->state = PARSER_ERROR;
     }
 
     if (parser->state == PARSER_ERROR || parser->curr.type == TOK_INVALID ||
         parser->curr.type == TOK_EOF) {
+        free(array->packed.ints);
         FREE_ARRAY(array);
         return NULL;
     }
 
+    if (array->storage != JSON_ARRAY_BOXED) {
+        // give back the slack of the last doubling
+        array->packed.ints = (int64_t *)realloc(array->packed.ints,
+                                                sizeof(int64_t) * array->n);
+        array->capacity = array->n;
+    } else {
+        // left over when the first element didn't pack
+        free(array->packed.ints);
+        array->packed.ints = NULL;
+    }
+
     Json *json = (Json *)malloc(sizeof(Json));
 
     if (json == NULL) {
@@ -188,6 +338,8 @@ static Json *node_array(Parser *parser) {
     }
 
     json->type = JSON_ARRAY;
+    json->hash = 0;
+    json->offset = start;
     json->value.array = *array;
 
     return json;
@@ -198,6 +350,7 @@ static Json *node_object(Parser *parser) {
         return NULL;
     }
     assert(parser->curr.type == TOK_OBJECT_START);
+    size_t start = parser->curr.offset;
 
     CREATE_ARRAY(JsonObject, JsonObjectMember, object);
 
@@ -218,9 +371,9 @@ static Json *node_object(Parser *parser) {
         // multiple kv pairs must be separated by comma
         if (object->n > 0 && token.type != TOK_COMMA) {
             parser->state = PARSER_ERROR;
-            LOG_ERROR("%s:%zu:%zu: Expected comma but got %s (\"%s\") instead",
-                      token.location.filepath, token.location.row,
-                      token.location.col, get_token_name(token), token.ptr);
+            LOG_ERROR_AT(parser->lexer, token.offset,
+                         "Expected comma but got %s (\"%s\") instead",
+                         get_token_name(token), token.ptr);
             break;
         }
 
@@ -230,8 +383,10 @@ static Json *node_object(Parser *parser) {
 
         if (token.type != TOK_STRING) {
             parser->curr.type = TOK_INVALID;
-            LOG_ERROR("parsing error: expected key but got %s (\"%s\") instead",
-                      get_token_name(token), token.ptr);
+            LOG_ERROR_AT(parser->lexer, token.offset,
+                         "parsing error: expected key but got %s (\"%s\") "
+                         "instead",
+                         get_token_name(token), token.ptr);
             parser->state = PARSER_ERROR;
             break;
         }
@@ -241,9 +396,10 @@ static Json *node_object(Parser *parser) {
         token = parser_get_token(parser);
         if (token.type != TOK_COLON) {
             parser->curr.type = TOK_INVALID;
-            LOG_ERROR("parsing error: expected colon (:) but got the token %s "
-                      "instead",
-                      get_token_name(token));
+            LOG_ERROR_AT(parser->lexer, token.offset,
+                         "parsing error: expected colon (:) but got the "
+                         "token %s instead",
+                         get_token_name(token));
             parser->state = PARSER_ERROR;
             break;
         }
@@ -260,7 +416,8 @@ static Json *node_object(Parser *parser) {
     }
 
     if (parser->curr.type != TOK_OBJECT_END) {
-        LOG_ERROR("Missing right brace ( } )");
+        LOG_ERROR_AT(parser->lexer, parser->curr.offset,
+                     "Missing right brace ( } )");
         parser->state = PARSER_ERROR;
     }
 
@@ -279,6 +436,8 @@ static Json *node_object(Parser *parser) {
     }
 
     json->type = JSON_OBJECT;
+    json->hash = 0;
+    json->offset = start;
     json->value.object = *object;
 
     return json;
@@ -301,68 +460,215 @@ static Json *node_s(Parser *parser) {
 }
 
 Json *json_parse(const char *filepath) {
-    Parser *parser = parser_init(filepath);
+    Source *source = source_open_file(filepath);
+    if (source == NULL)
+        return NULL;
+
+    Json *root = json_parse_source(source);
+
+    source_close(&source);
+    return root;
+}
+
+static Json *parse_source(Source *source, bool pack) {
+    Parser *parser = parser_init(source);
     if (parser == NULL)
         return NULL;
 
+    parser->pack = pack;
     Json *root = node_s(parser);
 
     parser_clean(&parser);
     return root;
 }
 
-void __json_print(Json *root, int current_indent, int indent_step) {
-    if (root == NULL)
+// parses json read from any input source, the source stays owned by the
+// caller
+Json *json_parse_source(Source *source) { return parse_source(source, false); }
+
+Json *json_parse_packed(const char *filepath) {
+    Source *source = source_open_file(filepath);
+    if (source == NULL)
+        return NULL;
+
+    Json *root = json_parse_source_packed(source);
+
+    source_close(&source);
+    return root;
+}
+
+Json *json_parse_source_packed(Source *source) {
+    return parse_source(source, true);
+}
+
+const int64_t *json_array_as_ints(Json *array) {
+    assert(array != NULL);
+    if (array->type != JSON_ARRAY ||
+        array->value.array.storage != JSON_ARRAY_INTS)
+        return NULL;
+    return array->value.array.packed.ints;
+}
+
+const double *json_array_as_doubles(Json *array) {
+    assert(array != NULL);
+    if (array->type != JSON_ARRAY ||
+        array->value.array.storage != JSON_ARRAY_DOUBLES)
+        return NULL;
+    return array->value.array.packed.doubles;
+}
+
+// boxing races are settled with a compare and swap, the loser frees its copy
+Json **json_array_items(Json *array) {
+    assert(array != NULL && array->type == JSON_ARRAY);
+
+    JsonArray *items = &array->value.array;
+    Json **arr = __atomic_load_n(&items->arr, __ATOMIC_ACQUIRE);
+    if (arr != NULL)
+        return arr;
+
+    Json **boxed = array_box(items, array->offset);
+    if (boxed == NULL)
+        return NULL;
+
+    if (!__atomic_compare_exchange_n(&items->arr, &arr, boxed, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        for (size_t i = 0; i < items->n; i++)
+            json_free(&boxed[i]);
+        free(boxed);
+        return arr;
+    }
+    return boxed;
+}
+
+// frees the node and everything below it
+void json_free(Json **json_ptr) {
+    assert(json_ptr != NULL);
+
+    Json *json = *json_ptr;
+    if (json == NULL)
         return;
-    switch (root->type) {
-
-    case JSON_OBJECT: {
-        printf("{\n");
-        for (int i = 0; i < root->value.object.n; i++) {
-            if (i > 0)
-                printf(",\n");
-            printf("%*c", (current_indent + indent_step), ' ');
-            printf("\"%s\": ", root->value.object.arr[i].key);
-            __json_print(root->value.object.arr[i].value,
-                         current_indent + indent_step, indent_step);
+
+    switch (json->type) {
+    case JSON_OBJECT:
+        for (size_t i = 0; i < json->value.object.n; i++) {
+            free((char *)json->value.object.arr[i].key);
+            json_free(&json->value.object.arr[i].value);
         }
-        printf("\n%*c}", current_indent, ' ');
+        free(json->value.object.arr);
         break;
-    }
-    case JSON_ARRAY: {
-        printf("[\n");
-        for (int i = 0; i < root->value.array.n; i++) {
-            if (i > 0)
-                printf(",\n");
-            printf("%*c", (current_indent + indent_step), ' ');
-            __json_print(root->value.array.arr[i], current_indent + indent_step,
-                         indent_step);
+    case JSON_ARRAY:
+        if (json->value.array.arr != NULL) {
+            for (size_t i = 0; i < json->value.array.n; i++)
+                json_free(&json->value.array.arr[i]);
+            free(json->value.array.arr);
         }
-        printf("\n%*c]", current_indent, ' ');
+        free(json->value.array.packed.ints);
         break;
-    }
-    case JSON_STRING: {
-        printf("\"%s\"", root->value.string);
-        break;
-    }
-    case JSON_BOOLEAN:
-        printf("%s", root->value.boolean ? "true" : "false");
+    case JSON_STRING:
+        free((char *)json->value.string);
         break;
     case JSON_NUMBER:
-        printf("%s", root->value.number.value);
+        free((char *)json->value.number.value);
         break;
+    case JSON_BOOLEAN:
     case JSON_NULL_VALUE:
-        printf("null");
-        break;
         break;
     }
+
+    free(json);
+    *json_ptr = NULL;
 }
 
-void json_print(Json *root, int indent) {
-    if (root == NULL) {
-        return;
+// converts a number to int64_t, floats are truncated
+int64_t json_number_int(JsonNumber number) {
+    if (number.type == JSON_NUMBER_INT)
+        return strtoll(number.value, NULL, 10);
+    return (int64_t)strtod(number.value, NULL);
+}
+
+// converts a number to double
+double json_number_double(JsonNumber number) {
+    return strtod(number.value, NULL);
+}
+
+static void line_index_scan(JsonLineIndex *index, const char *buf, size_t n,
+                            size_t base) {
+    const char *end = buf + n;
+
+    for (const char *p = buf; (p = memchr(p, '\n', end - p)) != NULL; p++) {
+        if (index->n == index->capacity) {
+            index->capacity *= 2;
+            index->arr = (size_t *)realloc(index->arr,
+                                           sizeof(size_t) * index->capacity);
+        }
+        index->arr[index->n++] = base + (p - buf);
+    }
+}
+
+// records the offset of every newline in the source, which is read to the end
+JsonLineIndex *json_line_index(Source *source) {
+    assert(source != NULL);
+
+    CREATE_ARRAY(JsonLineIndex, size_t, index);
+    if (index == NULL)
+        return NULL;
+
+    if (source->span != NULL) {
+        size_t len;
+        const char *span = source->span(source, &len);
+        line_index_scan(index, span, len, 0);
+        return index;
+    }
+
+    char buf[LEXER_BUFFER_LENGTH];
+    size_t base = 0;
+    ssize_t n;
+
+    while ((n = source_read(source, buf, sizeof(buf))) > 0) {
+        line_index_scan(index, buf, n, base);
+        base += n;
+    }
+
+    return index;
+}
+
+void json_line_index_free(JsonLineIndex **index_ptr) {
+    assert(index_ptr != NULL && *index_ptr != NULL);
+    FREE_ARRAY((*index_ptr));
+}
+
+// maps a byte offset to its 1-based line and column
+JsonPosition json_line_index_position(JsonLineIndex *index, size_t offset) {
+    // number of newlines before offset
+    size_t lo = 0, hi = index->n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (index->arr[mid] < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
 
-    __json_print(root, 0, indent);
-    printf("\n");
-}
\ No newline at end of file
+    size_t line_start = lo > 0 ? index->arr[lo - 1] + 1 : 0;
+    return (JsonPosition){.row = lo + 1, .col = offset - line_start + 1};
+}
+
+// finds where node was parsed from in the file by rescanning it. build a
+// line index once instead when resolving many nodes
+bool json_node_position(const char *filepath, Json *node,
+                        JsonPosition *position) {
+    assert(node != NULL && position != NULL);
+
+    Source *source = source_open_file(filepath);
+    if (source == NULL)
+        return false;
+
+    JsonLineIndex *index = json_line_index(source);
+    source_close(&source);
+    if (index == NULL)
+        return false;
+
+    *position = json_line_index_position(index, node->offset);
+    json_line_index_free(&index);
+    return true;
+}
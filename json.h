@@ -3,9 +3,13 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
+#include "source.h"
+
 typedef struct Json Json;
+typedef struct JsonDocument JsonDocument;
 
 typedef enum {
     JSON_OBJECT,
@@ -29,15 +33,30 @@ typedef struct {
     size_t capacity;
 } JsonObject;
 
+typedef enum {
+    JSON_ARRAY_BOXED,  /* a node per element in arr */
+    JSON_ARRAY_INTS,   /* every element is an int, stored in packed.ints */
+    JSON_ARRAY_DOUBLES /* every element is a float, stored in packed.doubles */
+} JsonArrayStorage;
+
+// Trees from json_parse_packed store arrays holding only ints, or only
+// floats, in a contiguous buffer as long as every number prints back as it
+// was written. Their arr is NULL until json_array_items boxes the elements.
+// Packed elements have no offsets of their own, their boxed nodes carry the
+// offset of the array. Trees from json_parse keep every array boxed.
 typedef struct {
     Json **arr;
     size_t n;
     size_t capacity;
+    JsonArrayStorage storage;
+    union {
+        int64_t *ints;
+        double *doubles;
+    } packed;
 } JsonArray;
 
 typedef const char *JsonString;
 
-// TODO: declare function to convert this to corresponding to int and float
 typedef struct {
     JsonNumberType type;
     const char *value;
@@ -56,10 +75,128 @@ typedef union {
 struct Json {
     JsonType type;
     JsonValue value;
+    uint64_t hash; /* cached content hash, 0 until json_hash computes it */
+    size_t offset; /* byte offset of the value in the input */
 };
 
+typedef struct {
+    size_t row;
+    size_t col;
+} JsonPosition;
+
+typedef struct {
+    size_t *arr; /* offsets of the newlines */
+    size_t n;
+    size_t capacity;
+} JsonLineIndex;
+
+typedef enum { JSON_DIFF_ADD, JSON_DIFF_REMOVE, JSON_DIFF_REPLACE } JsonDiffOp;
+
+typedef struct {
+    JsonDiffOp op;
+    char *path;  /* json pointer to the changed location */
+    Json *value; /* new value, NULL for JSON_DIFF_REMOVE */
+} JsonDiffEntry;
+
+typedef struct {
+    JsonDiffEntry *arr;
+    size_t n;
+    size_t capacity;
+} JsonDiff;
+
+typedef enum {
+    JSON_COLUMN_EMPTY, /* every row is null or missing */
+    JSON_COLUMN_INT,
+    JSON_COLUMN_DOUBLE,
+    JSON_COLUMN_BOOLEAN,
+    JSON_COLUMN_STRING
+} JsonColumnType;
+
+typedef struct {
+    const char *name;
+    JsonColumnType type;
+    size_t n;          /* number of rows */
+    size_t mismatched; /* rows whose value didn't fit the type, stored as null */
+    uint8_t *valid;    /* bitmap, bit i is set when row i holds a value */
+    union {
+        int64_t *ints;
+        double *doubles;
+        uint8_t *booleans; /* bitmap */
+        char *bytes;       /* string bodies, back to back */
+    } data;
+    size_t *offsets; /* string row i spans bytes[offsets[i]..offsets[i + 1]) */
+    size_t bytes_len;
+    size_t bytes_capacity;
+    size_t capacity;
+} JsonColumn;
+
+typedef struct {
+    JsonColumn *arr;
+    size_t n;
+    size_t rows;
+} JsonColumns;
+
+int64_t json_number_int(JsonNumber number);
+double json_number_double(JsonNumber number);
+
+/* packed elements of an array, NULL when it isn't stored that way */
+const int64_t *json_array_as_ints(Json *array);
+const double *json_array_as_doubles(Json *array);
+/* element nodes of an array, boxing packed arrays on first call */
+Json **json_array_items(Json *array);
+
 Json *json_parse(const char *filepath);
+Json *json_parse_source(Source *source);
+/* like json_parse, but packs arrays of numbers, see JsonArray */
+Json *json_parse_packed(const char *filepath);
+Json *json_parse_source_packed(Source *source);
+void json_free(Json **json_ptr);
+
+// default memory budget of the document cache
+#define JSON_CACHE_DEFAULT_BUDGET (256 * 1024 * 1024)
+
+/* returns the parsed file from a process wide cache, shared between callers
+ * and keyed by path, inode, size and mtime. the document is read-only, every
+ * call must be paired with json_document_release */
+JsonDocument *json_parse_cached(const char *filepath);
+Json *json_document_root(JsonDocument *document);
+void json_document_release(JsonDocument **document_ptr);
+/* least recently used documents are evicted once the cached trees take more
+ * than budget bytes, held documents stay valid until released */
+void json_cache_set_budget(size_t budget);
+void json_cache_clear(void);
+
+JsonLineIndex *json_line_index(Source *source);
+JsonPosition json_line_index_position(JsonLineIndex *index, size_t offset);
+void json_line_index_free(JsonLineIndex **index_ptr);
+bool json_node_position(const char *filepath, Json *node,
+                        JsonPosition *position);
 void json_print(Json *json, int indent);
 void json_fprint(FILE *fp, Json *json, int indent);
+void json_fprint_parallel(FILE *fp, Json *json, int indent, int threads);
+
+/* stream the input straight to out without building a tree, validating it on
+ * the way. reformat matches the layout of json_fprint */
+bool json_minify(Source *in, FILE *out);
+bool json_reformat(Source *in, FILE *out, int indent);
+
+/* hashes are 64 bit and cached in the nodes. json_equal only uses them to
+ * reject, json_diff also treats containers with equal hashes as identical */
+uint64_t json_hash(Json *json);
+bool json_equal(Json *a, Json *b);
+JsonDiff *json_diff(Json *a, Json *b);
+void json_diff_free(JsonDiff **diff_ptr);
+void json_diff_fprint_patch(FILE *fp, JsonDiff *diff);
+
+/* columns of an int array are promoted to double when a float shows up */
+JsonColumns *json_to_columns(Json *array, const char **fields,
+                             size_t n_fields);
+JsonColumns *json_parse_columns(Source *source, const char **fields,
+                                size_t n_fields);
+void json_columns_free(JsonColumns **columns_ptr);
+bool json_column_valid(const JsonColumn *column, size_t row);
+bool json_column_boolean(const JsonColumn *column, size_t row);
+const char *json_column_string(const JsonColumn *column, size_t row,
+                               size_t *len);
 
 #endif // __JSON_H__
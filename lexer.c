@@ -14,49 +14,84 @@
 #define TOK(token_type)                                                        \
     (Token) { .type = token_type }
 
-#define TOK_AT(token_type, loc)                                                \
-    (Token) { .type = token_type, .location = loc }
+#define TOK_AT(token_type, at)                                                 \
+    (Token) { .type = token_type, .offset = at }
 
 static char lexer_read(Lexer *lexer);
 static char lexer_current_char(Lexer *lexer);
 static Token lexer_get_number(Lexer *lexer);
 static Token lexer_get_string(Lexer *lexer);
 static inline bool is_whitespace(char c);
+static inline size_t lexer_position(Lexer *lexer);
+static void lexer_mark(Lexer *lexer);
+static void lexer_lexeme(Lexer *lexer, Token *token, size_t end);
+
+// returned once the source is exhausted, so that pushing back a character
+// read at the end of input keeps working
+static const char eof_sentinel[1] = {EOF};
 
 // initializes a lexer instance
-Lexer *lexer_init(const char *filepath) {
-    assert(filepath != NULL);
+Lexer *lexer_init(Source *source) {
+    assert(source != NULL);
 
     Lexer *lexer = (Lexer *)malloc(sizeof(Lexer));
 
     if (lexer == NULL)
         return NULL;
 
-    lexer->fp = fopen(filepath, "r");
-    if (lexer->fp == NULL) {
-        LOG_ERROR("failed to open file: %s", strerror(errno));
-        return NULL;
+    lexer->source = source;
+    lexer->eof = false;
+    lexer->span = NULL;
+    lexer->span_len = 0;
+    lexer->consumed = 0;
+    lexer->lines = 0;
+    lexer->line_start = 0;
+    lexer->buffer.buf = lexer->buffer.storage;
+    lexer->buffer.len = 0;
+    lexer->buffer.offset = 0;
+    lexer->scratch = (Scratch){0};
+
+    // scan inputs that are already in memory in place
+    if (source->span != NULL) {
+        lexer->span = source->span(source, &lexer->span_len);
+        lexer->buffer.buf = lexer->span;
+        lexer->buffer.len = lexer->span_len;
+        lexer->eof = true;
     }
 
-    lexer->location.row = 1;
-    lexer->location.col = 0;
-    lexer->location.filepath = filepath;
-    // setting offset to LEXER_BUFFER_LENGTH to read data on first call of
-    // lexer_read
-    lexer->buffer = (Buffer){.buf = {0}, .offset = LEXER_BUFFER_LENGTH};
     return lexer;
 }
 
 // frees the lexer and sets it to NULL
 void lexer_free(Lexer **lexer_ptr) {
     assert(lexer_ptr != NULL && *lexer_ptr != NULL);
-    fclose((*lexer_ptr)->fp);
+    free((*lexer_ptr)->scratch.buf);
     free(*lexer_ptr);
     *lexer_ptr = NULL;
 }
 
-// returns next token from the input
+// returns next token from the input, with a copy of its lexeme
 Token lexer_get_token(Lexer *lexer) {
+    Token token = lexer_view_token(lexer);
+
+    if (token.ptr == NULL)
+        return token;
+
+    char *copy = (char *)malloc(token.len + 1);
+    if (copy == NULL) {
+        LOG_ERROR("failed to allocate memory for token: %s", strerror(errno));
+        return TOK_AT(TOK_INVALID, token.offset);
+    }
+
+    memcpy(copy, token.ptr, token.len);
+    copy[token.len] = 0;
+    token.ptr = copy;
+    return token;
+}
+
+// returns next token from the input, its lexeme pointing into the chunk it
+// was read from or into the scratch buffer
+Token lexer_view_token(Lexer *lexer) {
     assert(lexer != NULL);
 
     char curr = lexer_read(lexer);
@@ -65,54 +100,142 @@ Token lexer_get_token(Lexer *lexer) {
     while (is_whitespace(curr))
         curr = lexer_read(lexer);
 
+    size_t start = lexer_position(lexer);
+
     switch (curr) {
     case '{':
-        return TOK_AT(TOK_OBJECT_START, lexer->location);
+        return TOK_AT(TOK_OBJECT_START, start);
     case '}':
-        return TOK_AT(TOK_OBJECT_END, lexer->location);
+        return TOK_AT(TOK_OBJECT_END, start);
     case '[':
-        return TOK_AT(TOK_ARRAY_START, lexer->location);
+        return TOK_AT(TOK_ARRAY_START, start);
     case ']':
-        return TOK_AT(TOK_ARRAY_END, lexer->location);
+        return TOK_AT(TOK_ARRAY_END, start);
     case ':':
-        return TOK_AT(TOK_COLON, lexer->location);
+        return TOK_AT(TOK_COLON, start);
     case ',':
-        return TOK_AT(TOK_COMMA, lexer->location);
+        return TOK_AT(TOK_COMMA, start);
     case '"':
         return lexer_get_string(lexer);
     case EOF:
-        return TOK_AT(TOK_EOF, lexer->location);
+        return TOK_AT(TOK_EOF, start);
     }
 
     // tokenize numbers
     if (isdigit(curr) || curr == '-')
         return lexer_get_number(lexer);
 
-    Token token = TOK_AT(TOK_INVALID, lexer->location);
-
     // tokenize true, false, and null
-    NEW_STRING(identifier);
+    Token token = TOK_AT(TOK_STRING, start);
+    lexer_mark(lexer);
 
-    do {
-        APPEND_STRING(identifier, lexer_current_char(lexer));
-    } while (isalpha(lexer_read(lexer)));
+    while (isalpha(lexer_read(lexer)))
+        ;
 
-    if (strcmp(identifier.buf, "true") == 0) {
+    lexer->buffer.offset--;
+    lexer_lexeme(lexer, &token, lexer->buffer.offset);
+
+    if (token.len == 4 && memcmp(token.ptr, "true", 4) == 0) {
         token.type = TOK_TRUE;
-    } else if (strcmp(identifier.buf, "false") == 0) {
+    } else if (token.len == 5 && memcmp(token.ptr, "false", 5) == 0) {
         token.type = TOK_FALSE;
-    } else if (strcmp(identifier.buf, "null") == 0) {
+    } else if (token.len == 4 && memcmp(token.ptr, "null", 4) == 0) {
         token.type = TOK_NULL;
     } else {
-        LOG_ERROR("Invalid token '%s'", identifier.buf);
+        if (token.type != TOK_INVALID)
+            LOG_ERROR_AT(lexer, start, "Invalid token '%.*s'", (int)token.len,
+                         token.ptr);
+        token.type = TOK_INVALID;
     }
 
-    lexer->buffer.offset--;
-
-    FREE_STRING(identifier);
+    token.ptr = NULL;
+    token.len = 0;
     return token;
 }
 
+// consumes the rest of a value whose first token has been read, the lexemes
+// after the first are only viewed
+bool lexer_skip_value(Lexer *lexer, Token token) {
+    size_t depth = 0;
+
+    do {
+        switch (token.type) {
+        case TOK_OBJECT_START:
+        case TOK_ARRAY_START:
+            depth++;
+            break;
+        case TOK_OBJECT_END:
+        case TOK_ARRAY_END:
+        case TOK_COLON:
+        case TOK_COMMA:
+            // only valid inside the value being skipped
+            if (depth == 0)
+                goto unexpected;
+            if (token.type == TOK_OBJECT_END || token.type == TOK_ARRAY_END)
+                depth--;
+            break;
+        case TOK_INVALID:
+        case TOK_EOF:
+            goto unexpected;
+        default:
+            break;
+        }
+
+        if (depth == 0)
+            return true;
+        token = lexer_view_token(lexer);
+    } while (true);
+
+unexpected:
+    LOG_ERROR_AT(lexer, token.offset, "expected value but got %s",
+                 get_token_name(token));
+    return false;
+}
+
+// frees the lexeme of a string or number token
+void free_token(Token token) { free((char *)token.ptr); }
+
+// counts the newlines in buf[0..n), remembering where the last line starts
+static void count_lines(const char *buf, size_t n, size_t base, size_t *lines,
+                        size_t *line_start) {
+    const char *end = buf + n;
+    const char *p = buf;
+
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        (*lines)++;
+        p++;
+        *line_start = base + (p - buf);
+    }
+}
+
+// resolves a byte offset to its line and column. locations are only needed
+// for diagnostics, so instead of tracking them per byte the input is
+// rescanned: all of it for in-memory inputs, the current chunk otherwise
+Location lexer_locate(Lexer *lexer, size_t offset) {
+    Location location = {
+        .row = 0, .col = 0, .offset = offset, .filepath = lexer->source->name};
+    size_t lines = 0, line_start = 0;
+
+    if (lexer->span != NULL) {
+        if (offset > lexer->span_len)
+            offset = lexer->span_len;
+        count_lines(lexer->span, offset, 0, &lines, &line_start);
+    } else if (offset >= lexer->consumed) {
+        lines = lexer->lines;
+        line_start = lexer->line_start;
+        size_t n = offset - lexer->consumed;
+        if (lexer->buffer.buf != eof_sentinel && n <= lexer->buffer.len)
+            count_lines(lexer->buffer.buf, n, lexer->consumed, &lines,
+                        &line_start);
+    } else {
+        return location;
+    }
+
+    location.row = lines + 1;
+    location.col = offset - line_start + 1;
+    return location;
+}
+
 // returns string representation of token
 const char *get_token_name(Token token) {
     switch (token.type) {
@@ -148,22 +271,121 @@ const char *get_token_name(Token token) {
     return NULL;
 }
 
-static char lexer_read(Lexer *lexer) {
-    if (lexer->buffer.offset == LEXER_BUFFER_LENGTH) {
-        fread(lexer->buffer.buf, sizeof(char), LEXER_BUFFER_LENGTH, lexer->fp);
-        lexer->buffer.offset = 0;
+// appends to the scratch buffer, remembering a failure so that the lexeme
+// is rejected instead of returned incomplete
+static void scratch_append(Scratch *scratch, const char *buf, size_t n) {
+    if (scratch->failed || n == 0)
+        return;
+
+    if (scratch->len + n > scratch->capacity) {
+        size_t capacity = scratch->capacity == 0 ? 64 : scratch->capacity;
+        while (capacity < scratch->len + n)
+            capacity *= 2;
+
+        char *grown = (char *)realloc(scratch->buf, capacity);
+        if (grown == NULL) {
+            LOG_ERROR("failed to allocate memory for token: %s",
+                      strerror(errno));
+            scratch->failed = true;
+            return;
+        }
+        scratch->buf = grown;
+        scratch->capacity = capacity;
+    }
+
+    memcpy(scratch->buf + scratch->len, buf, n);
+    scratch->len += n;
+}
+
+// starts a lexeme at the last character read
+static void lexer_mark(Lexer *lexer) {
+    lexer->scratch.mark = lexer->buffer.offset - 1;
+    lexer->scratch.len = 0;
+    lexer->scratch.active = true;
+    lexer->scratch.failed = false;
+}
+
+// ends the lexeme at offset end of the current chunk and points the token at
+// it. a lexeme that began in an earlier chunk is completed in scratch
+static void lexer_lexeme(Lexer *lexer, Token *token, size_t end) {
+    Scratch *scratch = &lexer->scratch;
+    const char *start = lexer->buffer.buf + scratch->mark;
+
+    scratch->active = false;
+
+    if (scratch->len == 0 && !scratch->failed) {
+        token->ptr = start;
+        token->len = end - scratch->mark;
+        return;
+    }
+
+    scratch_append(scratch, start, end - scratch->mark);
+    if (scratch->failed) {
+        token->type = TOK_INVALID;
+        return;
+    }
+
+    token->ptr = scratch->buf;
+    token->len = scratch->len;
+}
+
+static void lexer_fill(Lexer *lexer) {
+    const char *chunk = lexer->buffer.storage;
+    ssize_t n = 0;
+
+    // the chunk is about to be replaced, keep the part of the lexeme in it
+    if (lexer->scratch.active && lexer->buffer.buf != eof_sentinel)
+        scratch_append(&lexer->scratch,
+                       lexer->buffer.buf + lexer->scratch.mark,
+                       lexer->buffer.len - lexer->scratch.mark);
+    lexer->scratch.mark = 0;
+
+    // retire the current chunk, counting its lines in bulk so that errors
+    // past this point can still be located
+    if (lexer->buffer.buf != eof_sentinel) {
+        if (lexer->span == NULL)
+            count_lines(lexer->buffer.buf, lexer->buffer.len, lexer->consumed,
+                        &lexer->lines, &lexer->line_start);
+        lexer->consumed += lexer->buffer.len;
     }
 
-    char c = lexer->buffer.buf[lexer->buffer.offset++];
+    if (lexer->eof) {
+        // keep returning the sentinel
+    } else if (lexer->source->borrow != NULL) {
+        size_t len;
+        chunk = lexer->source->borrow(lexer->source, &len);
+        n = chunk != NULL ? (ssize_t)len : 0;
+        if (chunk == NULL && len == SOURCE_BORROW_ERROR)
+            LOG_ERROR("%s: failed to read input", lexer->source->name);
+    } else {
+        n = source_read(lexer->source, lexer->buffer.storage,
+                        LEXER_BUFFER_LENGTH);
+        if (n < 0)
+            LOG_ERROR("%s: failed to read input", lexer->source->name);
+    }
 
-    if (c == '\n') {
-        lexer->location.row++;
-        lexer->location.col = -1;
+    if (n <= 0) {
+        lexer->eof = true;
+        lexer->buffer.buf = eof_sentinel;
+        lexer->buffer.len = sizeof(eof_sentinel);
+    } else {
+        lexer->buffer.buf = chunk;
+        lexer->buffer.len = n;
     }
 
-    lexer->location.col++;
+    lexer->buffer.offset = 0;
+}
+
+static char lexer_read(Lexer *lexer) {
+    if (lexer->buffer.offset == lexer->buffer.len)
+        lexer_fill(lexer);
+
+    return lexer->buffer.buf[lexer->buffer.offset++];
+}
 
-    return c;
+// offset of the last character read
+static inline size_t lexer_position(Lexer *lexer) {
+    return lexer->consumed + lexer->buffer.offset - 1;
 }
 
 static char lexer_current_char(Lexer *lexer) {
@@ -181,132 +403,107 @@ static inline bool is_whitespace(char c) {
 }
 
 static Token lexer_get_string(Lexer *lexer) {
+    size_t start = lexer_position(lexer);
+
     if (lexer_current_char(lexer) != '"')
-        return TOK_AT(TOK_INVALID, lexer->location);
+        return TOK_AT(TOK_INVALID, start);
 
     // consume first quote (")
-    Location start = lexer->location;
     lexer_read(lexer);
+    lexer_mark(lexer);
 
-    NEW_STRING(str);
     Token tok = TOK_AT(TOK_STRING, start);
 
     // TODO: handle other characters
     while (lexer_current_char(lexer) != '"' &&
-           is_string_character(lexer_current_char(lexer))) {
-        APPEND_STRING(str, lexer_current_char(lexer));
+           is_string_character(lexer_current_char(lexer)))
         lexer_read(lexer);
-    }
 
     if (lexer_current_char(lexer) != '"') {
-        LOG_ERROR("%s:%zu:%zu: expected \" at the end of string",
-                  lexer->location.filepath, lexer->location.row,
-                  lexer->location.col);
+        LOG_ERROR_AT(lexer, lexer_position(lexer),
+                     "expected \" at the end of string");
+        lexer->scratch.active = false;
         tok.type = TOK_INVALID;
-        goto defer;
+        return tok;
     }
 
-    tok.len = str.n;
-    MOVE_STRING_TO_CSTR(str, tok.ptr);
-
-defer:
-    FREE_STRING(str);
+    lexer_lexeme(lexer, &tok, lexer->buffer.offset - 1);
     return tok;
 }
 
 static Token lexer_get_number(Lexer *lexer) {
-    Token tok = {.type = TOK_INVALID, .location = lexer->location};
-    NEW_STRING(number);
+    Token tok = {.type = TOK_INVALID, .offset = lexer_position(lexer)};
+    lexer_mark(lexer);
 
-    if (lexer_current_char(lexer) == '-') {
-        APPEND_STRING(number, '-');
+    if (lexer_current_char(lexer) == '-')
         lexer_read(lexer);
-    }
 
     int digits = 0;
     while (isdigit(lexer_current_char(lexer))) {
-        APPEND_STRING(number, lexer_current_char(lexer));
         lexer_read(lexer);
         digits++;
     }
 
     if (digits == 0) {
-        LOG_ERROR("%s:%zu:%zu: expected digit", lexer->location.filepath,
-                  lexer->location.row, lexer->location.col);
+        LOG_ERROR_AT(lexer, lexer_position(lexer), "expected digit");
         goto defer;
     }
 
-    if (lexer_current_char(lexer) == '.') {
-        APPEND_STRING(number, '.');
+    if (lexer_current_char(lexer) == '.')
         goto fraction;
-    }
 
-    if (tolower(lexer_current_char(lexer)) == 'e') {
-        APPEND_STRING(number, lexer_current_char(lexer));
+    if (tolower(lexer_current_char(lexer)) == 'e')
         goto exponent;
-    }
 
     lexer->buffer.offset--;
 
     tok.type = TOK_NUMBER_INT;
-    tok.len = number.n;
-    MOVE_STRING_TO_CSTR(number, tok.ptr);
     goto defer;
 
 fraction:
     digits = 0;
-    while (isdigit(lexer_read(lexer))) {
-        APPEND_STRING(number, lexer_current_char(lexer));
+    while (isdigit(lexer_read(lexer)))
         digits++;
-    }
 
     if (digits == 0) {
-        LOG_ERROR("%s:%zu:%zu: expected digit", lexer->location.filepath,
-                  lexer->location.row, lexer->location.col);
+        LOG_ERROR_AT(lexer, lexer_position(lexer), "expected digit");
         goto defer;
     }
 
-    if (tolower(lexer_current_char(lexer)) == 'e') {
-        APPEND_STRING(number, lexer_current_char(lexer));
+    if (tolower(lexer_current_char(lexer)) == 'e')
         goto exponent;
-    }
 
     lexer->buffer.offset--;
 
     tok.type = TOK_NUMBER_FLOAT;
-    tok.len = number.n;
-    MOVE_STRING_TO_CSTR(number, tok.ptr);
     goto defer;
 
 exponent:
     lexer_read(lexer);
 
-    if (lexer_current_char(lexer) == '+' || lexer_current_char(lexer) == '-') {
-        APPEND_STRING(number, lexer_current_char(lexer));
+    if (lexer_current_char(lexer) == '+' || lexer_current_char(lexer) == '-')
         lexer_read(lexer);
-    }
 
     digits = 0;
 
     while (isdigit(lexer_current_char(lexer))) {
-        APPEND_STRING(number, lexer_current_char(lexer));
         lexer_read(lexer);
         digits++;
     }
 
     if (digits == 0) {
-        LOG_ERROR("%s:%zu:%zu: expected digit", lexer->location.filepath,
-                  lexer->location.row, lexer->location.col);
+        LOG_ERROR_AT(lexer, lexer_position(lexer), "expected digit");
         goto defer;
     }
 
     lexer->buffer.offset--;
 
     tok.type = TOK_NUMBER_FLOAT;
-    tok.len = number.n;
-    MOVE_STRING_TO_CSTR(number, tok.ptr);
 
 defer:
-    FREE_STRING(number);
+    if (tok.type == TOK_INVALID)
+        lexer->scratch.active = false;
+    else
+        lexer_lexeme(lexer, &tok, lexer->buffer.offset);
     return tok;
 }
@@ -1,28 +1,65 @@
 #ifndef __LEXER_H__
 #define __LEXER_H__
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 
+#include "source.h"
+
 #define LEXER_BUFFER_LENGTH 4096
 
+// line and column of a byte offset, computed on demand by lexer_locate. row
+// is 0 when the offset lies in a chunk of a streamed input that is already
+// gone
 typedef struct {
     size_t row;
     size_t col;
+    size_t offset;
     const char *filepath;
 } Location;
 
+#define LOG_ERROR_AT(lexer, at, format, ...)                                   \
+    do {                                                                       \
+        Location loc = lexer_locate(lexer, at);                                \
+        if (loc.row > 0)                                                       \
+            LOG_ERROR("%s:%zu:%zu: " format, loc.filepath, loc.row, loc.col,   \
+                      ##__VA_ARGS__);                                          \
+        else                                                                   \
+            LOG_ERROR("%s: byte %zu: " format, loc.filepath, loc.offset,       \
+                      ##__VA_ARGS__);                                          \
+    } while (0)
+
 // TODO: handle unicode characters
 typedef struct {
-    char buf[LEXER_BUFFER_LENGTH];
+    const char *buf; /* points into storage, or at the source's span */
+    size_t len;
     size_t offset;
+    char storage[LEXER_BUFFER_LENGTH];
 } Buffer;
 
+// lexemes are returned in place when they lie within one chunk, the parts
+// of a lexeme that crosses chunks are collected here before the chunk goes
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t capacity;
+    size_t mark; /* start of the lexeme in the current chunk */
+    bool active; /* a lexeme is being scanned */
+    bool failed; /* part of the lexeme could not be kept */
+} Scratch;
+
 typedef struct {
-    Location location;
-    FILE *fp;
+    Source *source;
     Buffer buffer;
+    Scratch scratch;
+    bool eof;
+    const char *span; /* whole input when the source has a span */
+    size_t span_len;
+    size_t consumed;   /* bytes in the chunks before the current one */
+    size_t lines;      /* newlines in the chunks before the current one */
+    size_t line_start; /* offset just past the last of those newlines */
 } Lexer;
 
 typedef enum {
@@ -46,14 +83,23 @@ typedef struct {
     TokenType type;  /* type of token */
     const char *ptr; /* start of lexeme */
     size_t len;      /* length of lexeme */
-    Location location;
+    size_t offset;   /* byte offset of the token in the input */
 } Token;
 
-Lexer *lexer_init(const char *filepath);
+/* the source stays owned by the caller */
+Lexer *lexer_init(Source *source);
 void lexer_free(Lexer **lexer_ptr);
 
-/* retreives the next token */
+/* retreives the next token, the lexeme is owned by the caller */
 Token lexer_get_token(Lexer *lexer);
+/* retreives the next token without copying its lexeme, which is not nul
+ * terminated and stays valid until the next call */
+Token lexer_view_token(Lexer *lexer);
+/* consumes the rest of the value starting at token without building it.
+ * the lexeme of token is left to the caller */
+bool lexer_skip_value(Lexer *lexer, Token token);
 const char *get_token_name(Token token);
+void free_token(Token token);
+Location lexer_locate(Lexer *lexer, size_t offset);
 
 #endif // __LEXER_H__
\ No newline at end of file
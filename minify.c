@@ -0,0 +1,421 @@
+#include "json.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+#define REFORMAT_CHUNK_LENGTH (64 * 1024)
+
+// Reformatting runs a byte level state machine over the input chunks, so no
+// tokens or nodes are allocated and memory use only grows with nesting depth.
+// String bodies are located with memchr and copied in bulk, which glibc
+// vectorizes.
+
+typedef enum {
+    EXPECT_ROOT,
+    EXPECT_VALUE,
+    EXPECT_VALUE_OR_END, /* right after [ */
+    EXPECT_KEY,
+    EXPECT_KEY_OR_END, /* right after { */
+    EXPECT_COLON,
+    EXPECT_COMMA_OR_END,
+    EXPECT_NOTHING /* the root has been closed */
+} Expect;
+
+typedef enum {
+    IN_NONE,
+    IN_STRING,
+    IN_STRING_ESCAPE,
+    IN_NUMBER,
+    IN_LITERAL
+} Lexeme;
+
+// states of the json number grammar
+typedef enum {
+    NUM_MINUS,
+    NUM_ZERO,
+    NUM_INT,
+    NUM_DOT,
+    NUM_FRAC,
+    NUM_E,
+    NUM_E_SIGN,
+    NUM_EXP,
+    NUM_ERROR
+} NumberState;
+
+typedef struct {
+    Source *source;
+    FILE *out;
+    int indent_step;
+
+    char *obuf;
+    size_t on;
+
+    char *ibuf;
+    size_t consumed; /* bytes in the chunks before the current one */
+    bool first;
+    bool failed; /* the source could not be read */
+
+    Expect expect;
+    Lexeme lexeme;
+    bool key;          /* the string being copied is an object key */
+    bool pending_open; /* a container was opened and nothing followed yet */
+    NumberState number;
+    const char *literal; /* remaining characters of true, false or null */
+
+    char *stack; /* '{' or '[' per open container */
+    size_t depth;
+    size_t capacity;
+} Reformatter;
+
+static void out_flush(Reformatter *r) {
+    fwrite(r->obuf, sizeof(char), r->on, r->out);
+    r->on = 0;
+}
+
+static void out_write(Reformatter *r, const char *buf, size_t n) {
+    if (r->on + n > REFORMAT_CHUNK_LENGTH) {
+        out_flush(r);
+        if (n > REFORMAT_CHUNK_LENGTH) {
+            fwrite(buf, sizeof(char), n, r->out);
+            return;
+        }
+    }
+    memcpy(r->obuf + r->on, buf, n);
+    r->on += n;
+}
+
+static void out_putc(Reformatter *r, char c) { out_write(r, &c, 1); }
+
+static void out_newline(Reformatter *r, size_t depth) {
+    if (r->indent_step == 0)
+        return;
+
+    size_t n = depth * r->indent_step;
+    out_putc(r, '\n');
+    while (n > 0) {
+        static const char spaces[] = "                                ";
+        size_t len = n < sizeof(spaces) - 1 ? n : sizeof(spaces) - 1;
+        out_write(r, spaces, len);
+        n -= len;
+    }
+}
+
+static const char *input_next(Reformatter *r, size_t *len) {
+    Source *source = r->source;
+    bool first = r->first;
+    r->first = false;
+
+    if (source->span != NULL)
+        return first ? source->span(source, len) : (*len = 0, NULL);
+
+    if (source->borrow != NULL) {
+        const char *chunk = source->borrow(source, len);
+        r->failed = chunk == NULL && *len == SOURCE_BORROW_ERROR;
+        return chunk;
+    }
+
+    ssize_t n = source_read(source, r->ibuf, REFORMAT_CHUNK_LENGTH);
+    r->failed = n < 0;
+    *len = n > 0 ? n : 0;
+    return n > 0 ? r->ibuf : NULL;
+}
+
+static void reformat_error(Reformatter *r, size_t i, const char *message) {
+    LOG_ERROR("%s: byte %zu: %s", r->source->name, r->consumed + i, message);
+}
+
+static NumberState number_step(NumberState state, char c) {
+    bool digit = c >= '0' && c <= '9';
+
+    switch (state) {
+    case NUM_MINUS:
+        return c == '0' ? NUM_ZERO : digit ? NUM_INT : NUM_ERROR;
+    case NUM_ZERO:
+    case NUM_INT:
+        if (digit)
+            return state == NUM_INT ? NUM_INT : NUM_ERROR;
+        if (c == '.')
+            return NUM_DOT;
+        return c == 'e' || c == 'E' ? NUM_E : NUM_ERROR;
+    case NUM_DOT:
+    case NUM_FRAC:
+        if (digit)
+            return NUM_FRAC;
+        return state == NUM_FRAC && (c == 'e' || c == 'E') ? NUM_E : NUM_ERROR;
+    case NUM_E:
+        if (c == '+' || c == '-')
+            return NUM_E_SIGN;
+        // fallthrough
+    case NUM_E_SIGN:
+    case NUM_EXP:
+        return digit ? NUM_EXP : NUM_ERROR;
+    case NUM_ERROR:
+        break;
+    }
+    return NUM_ERROR;
+}
+
+static bool is_number_char(char c) {
+    return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' ||
+           c == 'e' || c == 'E';
+}
+
+static bool push(Reformatter *r, char open) {
+    if (r->depth == r->capacity) {
+        size_t capacity = r->capacity == 0 ? 32 : r->capacity * 2;
+        char *stack = (char *)realloc(r->stack, capacity);
+        if (stack == NULL) {
+            LOG_ERROR("failed to allocate memory for reformat: %s",
+                      strerror(errno));
+            return false;
+        }
+        r->stack = stack;
+        r->capacity = capacity;
+    }
+    r->stack[r->depth++] = open;
+    return true;
+}
+
+static void after_value(Reformatter *r) {
+    r->expect = r->depth == 0 ? EXPECT_NOTHING : EXPECT_COMMA_OR_END;
+}
+
+// emits the line break owed to a container that was just opened
+static void settle_open(Reformatter *r) {
+    if (r->pending_open) {
+        out_newline(r, r->depth);
+        r->pending_open = false;
+    }
+}
+
+// handles a byte outside of any lexeme, returns false on a structural error
+static bool structural(Reformatter *r, const char *chunk, size_t i) {
+    char c = chunk[i];
+    Expect expect = r->expect;
+    bool value_ok = expect == EXPECT_VALUE || expect == EXPECT_VALUE_OR_END ||
+                    expect == EXPECT_ROOT;
+
+    switch (c) {
+    case ' ':
+    case '\n':
+    case '\t':
+    case '\r':
+        return true;
+    case '{':
+    case '[':
+        if (!value_ok)
+            break;
+        settle_open(r);
+        if (!push(r, c))
+            return false;
+        out_putc(r, c);
+        r->pending_open = true;
+        r->expect = c == '{' ? EXPECT_KEY_OR_END : EXPECT_VALUE_OR_END;
+        return true;
+    case '}':
+    case ']': {
+        bool ok = c == '}' ? expect == EXPECT_KEY_OR_END
+                           : expect == EXPECT_VALUE_OR_END;
+        ok = ok || expect == EXPECT_COMMA_OR_END;
+        if (!ok || r->stack[r->depth - 1] != (c == '}' ? '{' : '['))
+            break;
+        r->depth--;
+        if (r->pending_open)
+            r->pending_open = false;
+        else
+            out_newline(r, r->depth);
+        out_putc(r, c);
+        after_value(r);
+        return true;
+    }
+    case ',':
+        if (expect != EXPECT_COMMA_OR_END)
+            break;
+        out_putc(r, ',');
+        out_newline(r, r->depth);
+        r->expect =
+            r->stack[r->depth - 1] == '{' ? EXPECT_KEY : EXPECT_VALUE;
+        return true;
+    case ':':
+        if (expect != EXPECT_COLON)
+            break;
+        out_write(r, ": ", r->indent_step > 0 ? 2 : 1);
+        r->expect = EXPECT_VALUE;
+        return true;
+    case '"':
+        if (expect != EXPECT_KEY && expect != EXPECT_KEY_OR_END &&
+            !(value_ok && expect != EXPECT_ROOT))
+            break;
+        settle_open(r);
+        out_putc(r, '"');
+        r->key = expect == EXPECT_KEY || expect == EXPECT_KEY_OR_END;
+        r->lexeme = IN_STRING;
+        return true;
+    case 't':
+    case 'f':
+    case 'n':
+        if (!value_ok || expect == EXPECT_ROOT)
+            break;
+        settle_open(r);
+        r->literal = c == 't' ? "rue" : c == 'f' ? "alse" : "ull";
+        r->lexeme = IN_LITERAL;
+        out_putc(r, c);
+        return true;
+    default:
+        if (!value_ok || expect == EXPECT_ROOT)
+            break;
+        // a leading digit is read as if it followed a minus sign
+        r->number = c == '-' ? NUM_MINUS : number_step(NUM_MINUS, c);
+        if (r->number == NUM_ERROR)
+            break;
+        settle_open(r);
+        r->lexeme = IN_NUMBER;
+        out_putc(r, c);
+        return true;
+    }
+
+    reformat_error(r, i,
+                   r->expect == EXPECT_NOTHING ? "unexpected data after root"
+                   : r->expect == EXPECT_ROOT  ? "expected object or array"
+                                               : "unexpected character");
+    return false;
+}
+
+static bool reformat_chunk(Reformatter *r, const char *chunk, size_t len) {
+    size_t i = 0;
+
+    while (i < len) {
+        switch (r->lexeme) {
+        case IN_STRING: {
+            const char *end = chunk + len;
+            const char *quote = memchr(chunk + i, '"', len - i);
+            const char *stop = quote != NULL ? quote : end;
+            const char *escape = memchr(chunk + i, '\\', stop - (chunk + i));
+
+            if (escape != NULL) {
+                // copy through the backslash, the escaped character follows
+                out_write(r, chunk + i, escape - (chunk + i) + 1);
+                i = escape - chunk + 1;
+                r->lexeme = IN_STRING_ESCAPE;
+            } else if (quote != NULL) {
+                out_write(r, chunk + i, quote - (chunk + i) + 1);
+                i = quote - chunk + 1;
+                r->lexeme = IN_NONE;
+                if (r->key)
+                    r->expect = EXPECT_COLON;
+                else
+                    after_value(r);
+            } else {
+                out_write(r, chunk + i, len - i);
+                i = len;
+            }
+            break;
+        }
+        case IN_STRING_ESCAPE:
+            out_putc(r, chunk[i++]);
+            r->lexeme = IN_STRING;
+            break;
+        case IN_NUMBER: {
+            size_t start = i;
+            while (i < len && is_number_char(chunk[i])) {
+                r->number = number_step(r->number, chunk[i]);
+                i++;
+            }
+            out_write(r, chunk + start, i - start);
+
+            if (r->number == NUM_ERROR) {
+                reformat_error(r, i - 1, "malformed number");
+                return false;
+            }
+
+            if (i < len) {
+                NumberState state = r->number;
+                if (state != NUM_ZERO && state != NUM_INT &&
+                    state != NUM_FRAC && state != NUM_EXP) {
+                    reformat_error(r, i, "malformed number");
+                    return false;
+                }
+                r->lexeme = IN_NONE;
+                after_value(r);
+            }
+            break;
+        }
+        case IN_LITERAL:
+            if (chunk[i] != *r->literal) {
+                reformat_error(r, i, "invalid literal");
+                return false;
+            }
+            out_putc(r, chunk[i++]);
+            if (*++r->literal == 0) {
+                r->lexeme = IN_NONE;
+                after_value(r);
+            }
+            break;
+        case IN_NONE:
+            if (!structural(r, chunk, i))
+                return false;
+            i++;
+            break;
+        }
+    }
+
+    return true;
+}
+
+// rewrites the json read from in to out in a single pass, indenting by indent
+// spaces per level or compactly when indent is 0. the input is validated
+// along the way, on error the output is left truncated
+bool json_reformat(Source *in, FILE *out, int indent) {
+    assert(in != NULL && out != NULL && indent >= 0);
+
+    Reformatter r = {.source = in,
+                     .out = out,
+                     .indent_step = indent,
+                     .first = true,
+                     .expect = EXPECT_ROOT,
+                     .lexeme = IN_NONE};
+
+    r.obuf = (char *)malloc(REFORMAT_CHUNK_LENGTH);
+    r.ibuf = (char *)malloc(REFORMAT_CHUNK_LENGTH);
+    if (r.obuf == NULL || r.ibuf == NULL) {
+        LOG_ERROR("failed to allocate memory for reformat: %s",
+                  strerror(errno));
+        free(r.obuf);
+        free(r.ibuf);
+        return false;
+    }
+
+    bool ok = true;
+    const char *chunk;
+    size_t len;
+
+    while (ok && (chunk = input_next(&r, &len)) != NULL && len > 0) {
+        ok = reformat_chunk(&r, chunk, len);
+        r.consumed += len;
+    }
+
+    if (ok && r.failed) {
+        LOG_ERROR("%s: failed to read input", in->name);
+        ok = false;
+    }
+
+    if (ok && r.expect != EXPECT_NOTHING) {
+        reformat_error(&r, 0, "unexpected end of input");
+        ok = false;
+    }
+
+    if (ok)
+        out_putc(&r, '\n');
+    out_flush(&r);
+
+    free(r.obuf);
+    free(r.ibuf);
+    free(r.stack);
+    return ok;
+}
+
+bool json_minify(Source *in, FILE *out) { return json_reformat(in, out, 0); }
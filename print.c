@@ -0,0 +1,439 @@
+#include "json.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "common.h"
+
+// defined in json.c
+int __json_packed_format(const JsonArray *array, size_t i, char *buf,
+                         size_t n);
+
+// the writer hands its buffer to the stream once it grows past this
+#define WRITER_FLUSH_LENGTH (64 * 1024)
+
+// containers with at least this many elements are split across workers
+#define PARALLEL_MIN_ELEMENTS 1024
+#define PARALLEL_MIN_CHUNK 256
+
+// formatted but unwritten segments allowed per worker
+#define PARALLEL_WINDOW_PER_THREAD 2
+
+// segments per writev, the smallest IOV_MAX posix allows
+#define PARALLEL_IOV_BATCH 16
+
+typedef struct {
+    String out;
+    FILE *fp; /* NULL keeps everything in memory */
+} Writer;
+
+static void writer_init(Writer *writer, FILE *fp) {
+    writer->out = (String){.buf = NULL, .capacity = 0, .n = 0};
+    writer->fp = fp;
+}
+
+static void writer_flush(Writer *writer) {
+    if (writer->fp != NULL && writer->out.n > 0) {
+        fwrite(writer->out.buf, sizeof(char), writer->out.n, writer->fp);
+        writer->out.n = 0;
+    }
+}
+
+static void writer_reserve(Writer *writer, size_t n) {
+    if (writer->out.n + n <= writer->out.capacity)
+        return;
+
+    size_t capacity = writer->out.capacity == 0 ? STRING_INITIAL_CAPACITY
+                                                : writer->out.capacity;
+    while (capacity < writer->out.n + n)
+        capacity *= 2;
+    writer->out.buf = (char *)realloc(writer->out.buf, capacity);
+    writer->out.capacity = capacity;
+}
+
+static void writer_write(Writer *writer, const char *str, size_t n) {
+    writer_reserve(writer, n);
+    memcpy(writer->out.buf + writer->out.n, str, n);
+    writer->out.n += n;
+
+    if (writer->out.n >= WRITER_FLUSH_LENGTH)
+        writer_flush(writer);
+}
+
+static void writer_puts(Writer *writer, const char *str) {
+    writer_write(writer, str, strlen(str));
+}
+
+static void writer_putc(Writer *writer, char c) { writer_write(writer, &c, 1); }
+
+// writes a newline followed by indent spaces, pretty mode only
+static void writer_newline(Writer *writer, int indent, int indent_step) {
+    if (indent_step == 0)
+        return;
+    writer_reserve(writer, indent + 1);
+    writer->out.buf[writer->out.n++] = '\n';
+    memset(writer->out.buf + writer->out.n, ' ', indent);
+    writer->out.n += indent;
+}
+
+static size_t container_length(Json *container) {
+    return container->type == JSON_OBJECT ? container->value.object.n
+                                          : container->value.array.n;
+}
+
+static void serialize_node(Writer *writer, Json *root, int current_indent,
+                           int indent_step);
+
+// writes the i-th element of a container along with its leading separator
+static void serialize_element(Writer *writer, Json *container, size_t i,
+                              int current_indent, int indent_step) {
+    int inner_indent = current_indent + indent_step;
+
+    if (i > 0)
+        writer_putc(writer, ',');
+    writer_newline(writer, inner_indent, indent_step);
+
+    if (container->type == JSON_OBJECT) {
+        JsonObjectMember *member = &container->value.object.arr[i];
+        writer_putc(writer, '"');
+        writer_puts(writer, member->key);
+        writer_puts(writer, indent_step > 0 ? "\": " : "\":");
+        serialize_node(writer, member->value, inner_indent, indent_step);
+    } else if (container->value.array.storage != JSON_ARRAY_BOXED) {
+        char buf[32];
+        int len =
+            __json_packed_format(&container->value.array, i, buf, sizeof(buf));
+        writer_write(writer, buf, len);
+    } else {
+        serialize_node(writer, container->value.array.arr[i], inner_indent,
+                       indent_step);
+    }
+}
+
+static void serialize_close(Writer *writer, Json *container,
+                            int current_indent, int indent_step) {
+    if (container_length(container) > 0)
+        writer_newline(writer, current_indent, indent_step);
+    writer_putc(writer, container->type == JSON_OBJECT ? '}' : ']');
+}
+
+static void serialize_node(Writer *writer, Json *root, int current_indent,
+                           int indent_step) {
+    if (root == NULL)
+        return;
+
+    switch (root->type) {
+    case JSON_OBJECT:
+    case JSON_ARRAY: {
+        writer_putc(writer, root->type == JSON_OBJECT ? '{' : '[');
+        size_t n = container_length(root);
+        for (size_t i = 0; i < n; i++)
+            serialize_element(writer, root, i, current_indent, indent_step);
+        serialize_close(writer, root, current_indent, indent_step);
+        break;
+    }
+    case JSON_STRING:
+        writer_putc(writer, '"');
+        writer_puts(writer, root->value.string);
+        writer_putc(writer, '"');
+        break;
+    case JSON_BOOLEAN:
+        writer_puts(writer, root->value.boolean ? "true" : "false");
+        break;
+    case JSON_NUMBER:
+        writer_puts(writer, root->value.number.value);
+        break;
+    case JSON_NULL_VALUE:
+        writer_puts(writer, "null");
+        break;
+    }
+}
+
+void __json_print(FILE *fp, Json *root, int current_indent, int indent_step) {
+    Writer writer;
+    writer_init(&writer, fp);
+    serialize_node(&writer, root, current_indent, indent_step);
+    writer_flush(&writer);
+    free(writer.out.buf);
+}
+
+// prints json to fp, indent of 0 prints it compactly on a single line
+void json_fprint(FILE *fp, Json *root, int indent) {
+    if (root == NULL) {
+        return;
+    }
+
+    __json_print(fp, root, 0, indent);
+    fputc('\n', fp);
+}
+
+void json_print(Json *root, int indent) { json_fprint(stdout, root, indent); }
+
+/* --------------------------- parallel mode --------------------------- */
+
+// A parallel print is planned as a sequence of segments. Literal segments
+// (brackets, keys, small values) are formatted up front, range segments cover
+// elements [lo, hi) of a large container and are formatted by the workers.
+typedef struct {
+    Writer writer;
+    Json *container; /* NULL for literal segments */
+    size_t lo;
+    size_t hi;
+    int indent; /* indentation of the container */
+    bool done;
+} Segment;
+
+typedef struct {
+    Segment *arr;
+    size_t n;
+    size_t capacity;
+    int threads;
+    int indent_step;
+    atomic_size_t next; /* next segment to be claimed by a worker */
+    size_t written;     /* segments already handed to the stream */
+    size_t window;      /* how far past written a worker may format */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} Plan;
+
+static Segment *plan_push(Plan *plan, Json *container) {
+    if (plan->n == plan->capacity) {
+        plan->capacity += 16;
+        plan->arr =
+            (Segment *)realloc(plan->arr, sizeof(Segment) * plan->capacity);
+    }
+
+    Segment *segment = &plan->arr[plan->n++];
+    writer_init(&segment->writer, NULL);
+    segment->container = container;
+    segment->done = container == NULL;
+    return segment;
+}
+
+// returns the literal segment at the end of the plan, starting one if needed
+static Writer *plan_literal(Plan *plan) {
+    if (plan->n == 0 || plan->arr[plan->n - 1].container != NULL)
+        plan_push(plan, NULL);
+    return &plan->arr[plan->n - 1].writer;
+}
+
+static void plan_node(Plan *plan, Json *node, int current_indent) {
+    int step = plan->indent_step;
+
+    if (node->type != JSON_OBJECT && node->type != JSON_ARRAY) {
+        serialize_node(plan_literal(plan), node, current_indent, step);
+        return;
+    }
+
+    size_t n = container_length(node);
+    writer_putc(plan_literal(plan), node->type == JSON_OBJECT ? '{' : '[');
+
+    if (n >= PARALLEL_MIN_ELEMENTS) {
+        // a few ranges per worker keeps them busy when ranges vary in size
+        size_t chunk = n / (plan->threads * 8);
+        if (chunk < PARALLEL_MIN_CHUNK)
+            chunk = PARALLEL_MIN_CHUNK;
+
+        for (size_t lo = 0; lo < n; lo += chunk) {
+            Segment *segment = plan_push(plan, node);
+            segment->lo = lo;
+            segment->hi = lo + chunk < n ? lo + chunk : n;
+            segment->indent = current_indent;
+        }
+    } else {
+        // small containers are walked here so that large ones nested in them
+        // can still be split
+        for (size_t i = 0; i < n; i++) {
+            Writer *literal = plan_literal(plan);
+            Json *child;
+
+            if (node->type == JSON_ARRAY &&
+                node->value.array.storage != JSON_ARRAY_BOXED) {
+                serialize_element(literal, node, i, current_indent, step);
+                continue;
+            }
+
+            if (i > 0)
+                writer_putc(literal, ',');
+            writer_newline(literal, current_indent + step, step);
+
+            if (node->type == JSON_OBJECT) {
+                writer_putc(literal, '"');
+                writer_puts(literal, node->value.object.arr[i].key);
+                writer_puts(literal, step > 0 ? "\": " : "\":");
+                child = node->value.object.arr[i].value;
+            } else {
+                child = node->value.array.arr[i];
+            }
+
+            plan_node(plan, child, current_indent + step);
+        }
+    }
+
+    serialize_close(plan_literal(plan), node, current_indent, step);
+}
+
+static void *print_worker(void *arg) {
+    Plan *plan = (Plan *)arg;
+
+    while (true) {
+        size_t i = atomic_fetch_add(&plan->next, 1);
+        if (i >= plan->n)
+            break;
+
+        Segment *segment = &plan->arr[i];
+        if (segment->container == NULL)
+            continue;
+
+        // bounds the formatted output held in memory ahead of the writer
+        pthread_mutex_lock(&plan->lock);
+        while (i >= plan->written + plan->window)
+            pthread_cond_wait(&plan->cond, &plan->lock);
+        pthread_mutex_unlock(&plan->lock);
+
+        for (size_t j = segment->lo; j < segment->hi; j++) {
+            serialize_element(&segment->writer, segment->container, j,
+                              segment->indent, plan->indent_step);
+        }
+
+        pthread_mutex_lock(&plan->lock);
+        segment->done = true;
+        pthread_cond_broadcast(&plan->cond);
+        pthread_mutex_unlock(&plan->lock);
+    }
+
+    return NULL;
+}
+
+static int write_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+// writes the segments out in order as the workers complete them, batching
+// consecutive finished segments into a single writev
+static void print_segments(FILE *fp, Plan *plan) {
+    int fd = fileno(fp);
+    bool failed = false;
+    struct iovec iov[PARALLEL_IOV_BATCH];
+    size_t k = 0;
+
+    fflush(fp);
+
+    while (k < plan->n) {
+        pthread_mutex_lock(&plan->lock);
+        while (!plan->arr[k].done)
+            pthread_cond_wait(&plan->cond, &plan->lock);
+        size_t end = k;
+        while (end < plan->n && plan->arr[end].done &&
+               end - k < PARALLEL_IOV_BATCH)
+            end++;
+        pthread_mutex_unlock(&plan->lock);
+
+        int count = 0;
+        for (size_t i = k; i < end; i++) {
+            Writer *writer = &plan->arr[i].writer;
+            if (fd < 0) {
+                fwrite(writer->out.buf, sizeof(char), writer->out.n, fp);
+            } else if (writer->out.n > 0) {
+                iov[count++] = (struct iovec){.iov_base = writer->out.buf,
+                                              .iov_len = writer->out.n};
+            }
+        }
+
+        if (!failed && count > 0 && write_all(fd, iov, count) < 0) {
+            LOG_ERROR("failed to write json: %s", strerror(errno));
+            failed = true;
+        }
+
+        for (size_t i = k; i < end; i++) {
+            free(plan->arr[i].writer.out.buf);
+            plan->arr[i].writer.out.buf = NULL;
+        }
+        k = end;
+
+        pthread_mutex_lock(&plan->lock);
+        plan->written = k;
+        pthread_cond_broadcast(&plan->cond);
+        pthread_mutex_unlock(&plan->lock);
+    }
+}
+
+// like json_fprint, but large containers are formatted in ranges on a pool
+// of threads (0 picks one per online cpu) and written out in order
+void json_fprint_parallel(FILE *fp, Json *root, int indent, int threads) {
+    if (root == NULL)
+        return;
+
+    if (threads <= 0)
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (threads <= 1) {
+        json_fprint(fp, root, indent);
+        return;
+    }
+
+    Plan plan = {.arr = NULL,
+                 .n = 0,
+                 .capacity = 0,
+                 .threads = threads,
+                 .indent_step = indent,
+                 .written = 0,
+                 .window = PARALLEL_WINDOW_PER_THREAD * threads};
+
+    plan_node(&plan, root, 0);
+    writer_putc(plan_literal(&plan), '\n');
+
+    atomic_init(&plan.next, 0);
+    pthread_mutex_init(&plan.lock, NULL);
+    pthread_cond_init(&plan.cond, NULL);
+
+    pthread_t *workers = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+    int started = 0;
+    if (workers != NULL) {
+        for (; started < threads; started++) {
+            if (pthread_create(&workers[started], NULL, print_worker, &plan))
+                break;
+        }
+    }
+
+    // without workers the segments are formatted on this thread, ahead of
+    // the writer
+    if (started == 0) {
+        plan.window = SIZE_MAX;
+        print_worker(&plan);
+    }
+
+    print_segments(fp, &plan);
+
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+
+    free(workers);
+    free(plan.arr);
+    pthread_cond_destroy(&plan.cond);
+    pthread_mutex_destroy(&plan.lock);
+}
@@ -0,0 +1,677 @@
+#include "source.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef JSON_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef JSON_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include "common.h"
+
+// size of the compressed input chunks pulled from the inner source
+#define SOURCE_CHUNK_LENGTH (64 * 1024)
+
+// reads up to n bytes from the source
+ssize_t source_read(Source *source, char *buf, size_t n) {
+    assert(source != NULL && source->read != NULL);
+    return source->read(source, buf, n);
+}
+
+// closes the source and sets it to NULL
+void source_close(Source **source_ptr) {
+    assert(source_ptr != NULL && *source_ptr != NULL);
+    (*source_ptr)->close(*source_ptr);
+    *source_ptr = NULL;
+}
+
+/* ------------------------------ memory ------------------------------ */
+
+typedef struct {
+    Source base;
+    const char *buf;
+    size_t len;
+    size_t offset;
+} MemorySource;
+
+static ssize_t memory_read(Source *source, char *buf, size_t n) {
+    MemorySource *mem = (MemorySource *)source;
+    size_t remaining = mem->len - mem->offset;
+    if (n > remaining)
+        n = remaining;
+    memcpy(buf, mem->buf + mem->offset, n);
+    mem->offset += n;
+    return n;
+}
+
+static const char *memory_span(Source *source, size_t *len) {
+    MemorySource *mem = (MemorySource *)source;
+    *len = mem->len;
+    return mem->buf;
+}
+
+static void memory_close(Source *source) { free(source); }
+
+// reads from a buffer owned by the caller, which must outlive the source
+Source *source_from_memory(const char *buf, size_t len, const char *name) {
+    assert(buf != NULL || len == 0);
+
+    MemorySource *mem = (MemorySource *)malloc(sizeof(MemorySource));
+    if (mem == NULL) {
+        LOG_ERROR("failed to allocate memory for source: %s", strerror(errno));
+        return NULL;
+    }
+
+    mem->base = (Source){.read = memory_read,
+                         .span = memory_span,
+                         .close = memory_close,
+                         .name = name};
+    mem->buf = buf;
+    mem->len = len;
+    mem->offset = 0;
+    return &mem->base;
+}
+
+/* ---------------------------- descriptors ---------------------------- */
+
+typedef struct {
+    Source base;
+    int fd;
+    bool owns_fd;
+    void *map; /* whole file when it could be mmap'd, otherwise NULL */
+    size_t map_len;
+} FdSource;
+
+static ssize_t fd_read(Source *source, char *buf, size_t n) {
+    FdSource *fds = (FdSource *)source;
+    ssize_t got;
+
+    do {
+        got = read(fds->fd, buf, n);
+    } while (got < 0 && errno == EINTR);
+
+    if (got < 0)
+        LOG_ERROR("%s: read failed: %s", source->name, strerror(errno));
+    return got;
+}
+
+static int fd_poll_fd(Source *source) { return ((FdSource *)source)->fd; }
+
+static const char *fd_span(Source *source, size_t *len) {
+    FdSource *fds = (FdSource *)source;
+    *len = fds->map_len;
+    return (const char *)fds->map;
+}
+
+static void fd_close(Source *source) {
+    FdSource *fds = (FdSource *)source;
+    if (fds->map != NULL)
+        munmap(fds->map, fds->map_len);
+    if (fds->owns_fd)
+        close(fds->fd);
+    free(fds);
+}
+
+static Source *fd_source_new(int fd, bool owns_fd, const char *name) {
+    FdSource *fds = (FdSource *)malloc(sizeof(FdSource));
+    if (fds == NULL) {
+        LOG_ERROR("failed to allocate memory for source: %s", strerror(errno));
+        return NULL;
+    }
+
+    fds->base = (Source){.read = fd_read,
+                         .poll_fd = fd_poll_fd,
+                         .close = fd_close,
+                         .name = name};
+    fds->fd = fd;
+    fds->owns_fd = owns_fd;
+    fds->map = NULL;
+    fds->map_len = 0;
+    return &fds->base;
+}
+
+// reads from a descriptor (file, pipe, socket) that stays owned by the caller
+Source *source_from_fd(int fd, const char *name) {
+    assert(fd >= 0);
+    return fd_source_new(fd, false, name);
+}
+
+static int open_file(const char *filepath) {
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0)
+        LOG_ERROR("failed to open file: %s", strerror(errno));
+    return fd;
+}
+
+// opens the file at filepath and reads it in chunks, a file truncated while
+// it is read just ends early
+Source *source_open_file(const char *filepath) {
+    assert(filepath != NULL);
+
+    int fd = open_file(filepath);
+    if (fd < 0)
+        return NULL;
+
+    Source *source = fd_source_new(fd, true, filepath);
+    if (source == NULL)
+        close(fd);
+    return source;
+}
+
+// opens the file at filepath and, for regular files, mmaps it so that it is
+// scanned in place. truncating the file while it is mapped raises SIGBUS, so
+// only map files that are never rewritten in place
+Source *source_map_file(const char *filepath) {
+    Source *source = source_open_file(filepath);
+    if (source == NULL)
+        return NULL;
+
+    FdSource *fds = (FdSource *)source;
+    struct stat st;
+    if (fstat(fds->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fds->fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            fds->map = map;
+            fds->map_len = st.st_size;
+            source->span = fd_span;
+        }
+    }
+
+    return source;
+}
+
+/* ------------------------------- stdio ------------------------------- */
+
+typedef struct {
+    Source base;
+    FILE *fp;
+} FileSource;
+
+static ssize_t fp_read(Source *source, char *buf, size_t n) {
+    FileSource *fs = (FileSource *)source;
+    size_t got = fread(buf, sizeof(char), n, fs->fp);
+
+    if (got == 0 && ferror(fs->fp)) {
+        LOG_ERROR("%s: read failed", source->name);
+        return -1;
+    }
+    return got;
+}
+
+static void fp_close(Source *source) { free(source); }
+
+// reads from a stdio stream that stays owned by the caller
+Source *source_from_fp(FILE *fp, const char *name) {
+    assert(fp != NULL);
+
+    FileSource *fs = (FileSource *)malloc(sizeof(FileSource));
+    if (fs == NULL) {
+        LOG_ERROR("failed to allocate memory for source: %s", strerror(errno));
+        return NULL;
+    }
+
+    fs->base = (Source){.read = fp_read, .close = fp_close, .name = name};
+    fs->fp = fp;
+    return &fs->base;
+}
+
+/* ----------------------------- read-ahead ----------------------------- */
+
+typedef struct {
+    char *buf;
+    size_t len;
+    bool full; /* filled by the reader and not yet released by the consumer */
+} ReadaheadBuffer;
+
+typedef struct {
+    Source base;
+    Source *inner;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    ReadaheadBuffer buffers[2];
+    size_t capacity;
+    int next;           /* buffer the consumer takes next */
+    int lent;           /* buffer lent to the consumer, -1 if none */
+    size_t lent_offset; /* bytes of the lent buffer already copied by read */
+    bool stop;          /* consumer is closing the source */
+    bool finished;      /* reader thread has posted its last buffer */
+    bool failed;        /* reading the inner source failed */
+    int wake[2];        /* written on close, -1 when inner can't be polled */
+} ReadaheadSource;
+
+// waits until inner has input or the source is being closed, returns false
+// in the latter case. a peer holding a pipe open can't keep close waiting
+static bool readahead_wait(ReadaheadSource *ra) {
+    struct pollfd fds[2] = {
+        {.fd = ra->inner->poll_fd(ra->inner), .events = POLLIN},
+        {.fd = ra->wake[0], .events = POLLIN}};
+
+    while (poll(fds, 2, -1) < 0) {
+        // the read blocks instead, as it does for sources without poll_fd
+        if (errno != EINTR)
+            return true;
+    }
+    return fds[1].revents == 0;
+}
+
+static void *readahead_thread(void *arg) {
+    ReadaheadSource *ra = (ReadaheadSource *)arg;
+    int idx = 0;
+
+    while (true) {
+        pthread_mutex_lock(&ra->lock);
+        while (ra->buffers[idx].full && !ra->stop)
+            pthread_cond_wait(&ra->cond, &ra->lock);
+        bool stop = ra->stop;
+        pthread_mutex_unlock(&ra->lock);
+
+        if (stop || (ra->wake[0] >= 0 && !readahead_wait(ra)))
+            break;
+
+        // the buffer is neither full nor lent, so it is safe to fill unlocked.
+        // whatever a single read returns is posted right away, a peer that
+        // sends one document and waits for the reply must not stall us
+        ReadaheadBuffer *buffer = &ra->buffers[idx];
+        ssize_t got = source_read(ra->inner, buffer->buf, ra->capacity);
+        if (got <= 0) {
+            pthread_mutex_lock(&ra->lock);
+            ra->failed = got < 0;
+            pthread_mutex_unlock(&ra->lock);
+            break;
+        }
+
+        pthread_mutex_lock(&ra->lock);
+        buffer->len = got;
+        buffer->full = true;
+        pthread_cond_broadcast(&ra->cond);
+        pthread_mutex_unlock(&ra->lock);
+
+        idx ^= 1;
+    }
+
+    pthread_mutex_lock(&ra->lock);
+    ra->finished = true;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+    return NULL;
+}
+
+static const char *readahead_borrow(Source *source, size_t *len) {
+    ReadaheadSource *ra = (ReadaheadSource *)source;
+    const char *chunk = NULL;
+    *len = 0;
+
+    pthread_mutex_lock(&ra->lock);
+
+    // hand the previous chunk back to the reader
+    if (ra->lent >= 0) {
+        ra->buffers[ra->lent].full = false;
+        ra->lent = -1;
+        pthread_cond_broadcast(&ra->cond);
+    }
+
+    ReadaheadBuffer *buffer = &ra->buffers[ra->next];
+    while (!buffer->full && !ra->finished)
+        pthread_cond_wait(&ra->cond, &ra->lock);
+
+    if (buffer->full) {
+        chunk = buffer->buf;
+        *len = buffer->len;
+        ra->lent = ra->next;
+        ra->lent_offset = 0;
+        ra->next ^= 1;
+    } else if (ra->failed) {
+        *len = SOURCE_BORROW_ERROR;
+    }
+
+    pthread_mutex_unlock(&ra->lock);
+    return chunk;
+}
+
+static ssize_t readahead_read(Source *source, char *buf, size_t n) {
+    ReadaheadSource *ra = (ReadaheadSource *)source;
+
+    if (ra->lent < 0 || ra->lent_offset == ra->buffers[ra->lent].len) {
+        size_t len;
+        if (readahead_borrow(source, &len) == NULL)
+            return len == SOURCE_BORROW_ERROR ? -1 : 0;
+    }
+
+    ReadaheadBuffer *buffer = &ra->buffers[ra->lent];
+    size_t remaining = buffer->len - ra->lent_offset;
+    if (n > remaining)
+        n = remaining;
+    memcpy(buf, buffer->buf + ra->lent_offset, n);
+    ra->lent_offset += n;
+    return n;
+}
+
+static void readahead_close_wake(ReadaheadSource *ra) {
+    for (int i = 0; i < 2; i++) {
+        if (ra->wake[i] >= 0)
+            close(ra->wake[i]);
+    }
+}
+
+static void readahead_close(Source *source) {
+    ReadaheadSource *ra = (ReadaheadSource *)source;
+
+    pthread_mutex_lock(&ra->lock);
+    ra->stop = true;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+
+    if (ra->wake[1] >= 0) {
+        ssize_t written;
+        do {
+            written = write(ra->wake[1], "", 1);
+        } while (written < 0 && errno == EINTR);
+    }
+
+    pthread_join(ra->thread, NULL);
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->lock);
+    readahead_close_wake(ra);
+    free(ra->buffers[0].buf);
+    free(ra->buffers[1].buf);
+    source_close(&ra->inner);
+    free(ra);
+}
+
+Source *source_readahead(Source *inner, size_t buffer_length) {
+    assert(inner != NULL);
+
+    if (buffer_length == 0)
+        buffer_length = SOURCE_READAHEAD_DEFAULT_LENGTH;
+
+    ReadaheadSource *ra = (ReadaheadSource *)malloc(sizeof(ReadaheadSource));
+    if (ra == NULL) {
+        LOG_ERROR("failed to allocate memory for source: %s", strerror(errno));
+        source_close(&inner);
+        return NULL;
+    }
+
+    ra->base = (Source){.read = readahead_read,
+                        .borrow = readahead_borrow,
+                        .close = readahead_close,
+                        .name = inner->name};
+    ra->inner = inner;
+    ra->capacity = buffer_length;
+    ra->next = 0;
+    ra->lent = -1;
+    ra->lent_offset = 0;
+    ra->stop = false;
+    ra->finished = false;
+    ra->failed = false;
+    ra->wake[0] = ra->wake[1] = -1;
+
+    // without a wake pipe close waits for the read in flight
+    if (inner->poll_fd != NULL && pipe(ra->wake) != 0) {
+        LOG_WARN("failed to create read-ahead wake pipe: %s", strerror(errno));
+        ra->wake[0] = ra->wake[1] = -1;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        ra->buffers[i] = (ReadaheadBuffer){
+            .buf = (char *)malloc(buffer_length), .len = 0, .full = false};
+    }
+
+    if (ra->buffers[0].buf == NULL || ra->buffers[1].buf == NULL) {
+        LOG_ERROR("failed to allocate read-ahead buffers: %s", strerror(errno));
+        goto fail;
+    }
+
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+
+    int err = pthread_create(&ra->thread, NULL, readahead_thread, ra);
+    if (err != 0) {
+        LOG_ERROR("failed to start read-ahead thread: %s", strerror(err));
+        pthread_cond_destroy(&ra->cond);
+        pthread_mutex_destroy(&ra->lock);
+        goto fail;
+    }
+
+    return &ra->base;
+
+fail:
+    readahead_close_wake(ra);
+    free(ra->buffers[0].buf);
+    free(ra->buffers[1].buf);
+    source_close(&ra->inner);
+    free(ra);
+    return NULL;
+}
+
+/* ------------------------------- gzip ------------------------------- */
+
+#ifdef JSON_WITH_ZLIB
+
+typedef struct {
+    Source base;
+    Source *inner;
+    z_stream zs;
+    bool eof; /* inner source is exhausted */
+    bool done;
+    char in[SOURCE_CHUNK_LENGTH];
+} GzipSource;
+
+static int gzip_refill(GzipSource *gz) {
+    ssize_t got = source_read(gz->inner, gz->in, SOURCE_CHUNK_LENGTH);
+    if (got < 0)
+        return -1;
+    if (got == 0)
+        gz->eof = true;
+    gz->zs.next_in = (Bytef *)gz->in;
+    gz->zs.avail_in = got;
+    return 0;
+}
+
+static ssize_t gzip_read(Source *source, char *buf, size_t n) {
+    GzipSource *gz = (GzipSource *)source;
+    if (gz->done)
+        return 0;
+
+    gz->zs.next_out = (Bytef *)buf;
+    gz->zs.avail_out = n;
+
+    while (gz->zs.avail_out > 0) {
+        if (gz->zs.avail_in == 0 && !gz->eof) {
+            // hand out what is decoded before waiting on more input
+            if (gz->zs.avail_out < n)
+                break;
+            if (gzip_refill(gz) < 0)
+                return -1;
+        }
+
+        int ret = inflate(&gz->zs, Z_NO_FLUSH);
+
+        if (ret == Z_STREAM_END) {
+            // a gzip file may hold several concatenated members
+            if (gz->zs.avail_in == 0 && !gz->eof && gzip_refill(gz) < 0)
+                return -1;
+            if (gz->zs.avail_in == 0) {
+                gz->done = true;
+                break;
+            }
+            inflateReset(&gz->zs);
+            continue;
+        }
+
+        if (ret == Z_BUF_ERROR && gz->eof && gz->zs.avail_in == 0) {
+            LOG_ERROR("%s: unexpected end of gzip stream", source->name);
+            return -1;
+        }
+
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            LOG_ERROR("%s: gzip: %s", source->name,
+                      gz->zs.msg ? gz->zs.msg : "corrupt stream");
+            return -1;
+        }
+    }
+
+    return n - gz->zs.avail_out;
+}
+
+static void gzip_close(Source *source) {
+    GzipSource *gz = (GzipSource *)source;
+    inflateEnd(&gz->zs);
+    source_close(&gz->inner);
+    free(gz);
+}
+
+Source *source_gzip(Source *inner) {
+    assert(inner != NULL);
+
+    GzipSource *gz = (GzipSource *)malloc(sizeof(GzipSource));
+    if (gz == NULL) {
+        LOG_ERROR("failed to allocate memory for source: %s", strerror(errno));
+        source_close(&inner);
+        return NULL;
+    }
+
+    memset(&gz->zs, 0, sizeof(z_stream));
+    // 15 + 32 accepts both gzip and zlib headers with the largest window
+    if (inflateInit2(&gz->zs, 15 + 32) != Z_OK) {
+        LOG_ERROR("%s: failed to initialize gzip decoder", inner->name);
+        source_close(&inner);
+        free(gz);
+        return NULL;
+    }
+
+    gz->base = (Source){
+        .read = gzip_read, .close = gzip_close, .name = inner->name};
+    gz->inner = inner;
+    gz->eof = false;
+    gz->done = false;
+    return &gz->base;
+}
+
+#else
+
+Source *source_gzip(Source *inner) {
+    assert(inner != NULL);
+
+    LOG_ERROR("%s: gzip support not compiled in, build with WITH_ZLIB=1",
+              inner->name);
+    source_close(&inner);
+    return NULL;
+}
+
+#endif // JSON_WITH_ZLIB
+
+/* ------------------------------- zstd ------------------------------- */
+
+#ifdef JSON_WITH_ZSTD
+
+typedef struct {
+    Source base;
+    Source *inner;
+    ZSTD_DStream *stream;
+    ZSTD_inBuffer input;
+    size_t pending; /* last hint returned by the decoder, 0 at frame end */
+    bool eof;       /* inner source is exhausted */
+    char in[SOURCE_CHUNK_LENGTH];
+} ZstdSource;
+
+static ssize_t zstd_read(Source *source, char *buf, size_t n) {
+    ZstdSource *zs = (ZstdSource *)source;
+    ZSTD_outBuffer output = {.dst = buf, .size = n, .pos = 0};
+
+    while (output.pos < output.size) {
+        if (zs->input.pos == zs->input.size && !zs->eof) {
+            // hand out what is decoded before waiting on more input
+            if (output.pos > 0)
+                break;
+            ssize_t got = source_read(zs->inner, zs->in, SOURCE_CHUNK_LENGTH);
+            if (got < 0)
+                return -1;
+            if (got == 0)
+                zs->eof = true;
+            zs->input = (ZSTD_inBuffer){.src = zs->in, .size = got, .pos = 0};
+        }
+
+        size_t before = output.pos;
+        size_t ret = ZSTD_decompressStream(zs->stream, &output, &zs->input);
+        if (ZSTD_isError(ret)) {
+            LOG_ERROR("%s: zstd: %s", source->name, ZSTD_getErrorName(ret));
+            return -1;
+        }
+        zs->pending = ret;
+
+        // the decoder can still flush buffered output after input runs out
+        if (zs->eof && zs->input.pos == zs->input.size &&
+            output.pos == before) {
+            if (zs->pending != 0) {
+                LOG_ERROR("%s: unexpected end of zstd stream", source->name);
+                return -1;
+            }
+            break;
+        }
+    }
+
+    return output.pos;
+}
+
+static void zstd_close(Source *source) {
+    ZstdSource *zs = (ZstdSource *)source;
+    ZSTD_freeDStream(zs->stream);
+    source_close(&zs->inner);
+    free(zs);
+}
+
+Source *source_zstd(Source *inner) {
+    assert(inner != NULL);
+
+    ZstdSource *zs = (ZstdSource *)malloc(sizeof(ZstdSource));
+    if (zs == NULL) {
+        LOG_ERROR("failed to allocate memory for source: %s", strerror(errno));
+        source_close(&inner);
+        return NULL;
+    }
+
+    zs->stream = ZSTD_createDStream();
+    if (zs->stream == NULL || ZSTD_isError(ZSTD_initDStream(zs->stream))) {
+        LOG_ERROR("%s: failed to initialize zstd decoder", inner->name);
+        ZSTD_freeDStream(zs->stream);
+        source_close(&inner);
+        free(zs);
+        return NULL;
+    }
+
+    zs->base = (Source){
+        .read = zstd_read, .close = zstd_close, .name = inner->name};
+    zs->inner = inner;
+    zs->input = (ZSTD_inBuffer){.src = zs->in, .size = 0, .pos = 0};
+    zs->pending = 0;
+    zs->eof = false;
+    return &zs->base;
+}
+
+#else
+
+Source *source_zstd(Source *inner) {
+    assert(inner != NULL);
+
+    LOG_ERROR("%s: zstd support not compiled in, build with WITH_ZSTD=1",
+              inner->name);
+    source_close(&inner);
+    return NULL;
+}
+
+#endif // JSON_WITH_ZSTD
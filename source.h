@@ -0,0 +1,62 @@
+#ifndef __SOURCE_H__
+#define __SOURCE_H__
+
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+typedef struct Source Source;
+
+// An input source feeds raw bytes to the lexer. Every source implements
+// `read`; sources whose whole input already lives in memory (memory buffers,
+// mmap'd files) also implement `span` so the lexer can scan it in place
+// without copying, and sources that fill their own buffers implement
+// `borrow` to lend them to the lexer one chunk at a time.
+struct Source {
+    /* reads up to n bytes into buf, returns 0 on end of input and -1 on error */
+    ssize_t (*read)(Source *source, char *buf, size_t n);
+    /* optional: returns the entire input as one contiguous span */
+    const char *(*span)(Source *source, size_t *len);
+    /* optional: lends the next chunk, valid until the following call. returns
+     * NULL at the end of input, setting len to 0, or SOURCE_BORROW_ERROR
+     * when reading failed */
+    const char *(*borrow)(Source *source, size_t *len);
+    /* optional: returns the descriptor that read blocks on, when poll
+     * reporting it readable means read won't block */
+    int (*poll_fd)(Source *source);
+    /* releases the source along with any resources it owns */
+    void (*close)(Source *source);
+    const char *name; /* used in diagnostics */
+};
+
+// length set by borrow when the input could not be read
+#define SOURCE_BORROW_ERROR ((size_t)-1)
+
+Source *source_open_file(const char *filepath);
+/* like source_open_file but mmaps regular files, which must not be truncated
+ * while the source is open */
+Source *source_map_file(const char *filepath);
+Source *source_from_fp(FILE *fp, const char *name);
+Source *source_from_fd(int fd, const char *name);
+Source *source_from_memory(const char *buf, size_t len, const char *name);
+
+/* decompress data read from inner and take ownership of it. gzip also
+ * accepts zlib data. they are always declared, but without WITH_ZLIB=1 or
+ * WITH_ZSTD=1 in the library build they log an error, close inner and
+ * return NULL */
+Source *source_gzip(Source *inner);
+Source *source_zstd(Source *inner);
+
+// default size of each read-ahead buffer
+#define SOURCE_READAHEAD_DEFAULT_LENGTH (4 * 1024 * 1024)
+
+/* reads inner on a background thread into two buffers of buffer_length bytes
+ * (0 picks the default) while the lexer consumes the other one, takes
+ * ownership of inner. closing doesn't wait for a peer that keeps a pipe or
+ * socket open when inner has a poll_fd, as descriptor sources do */
+Source *source_readahead(Source *inner, size_t buffer_length);
+
+ssize_t source_read(Source *source, char *buf, size_t n);
+void source_close(Source **source_ptr);
+
+#endif // __SOURCE_H__
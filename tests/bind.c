@@ -0,0 +1,287 @@
+// Decodes into bound structs: nested structs, arrays of structs, a binding
+// that refers to itself, repeated keys and values of the wrong type. Every
+// document is also read one byte at a time, so that keys, strings and
+// numbers cross chunk boundaries. Run it under `make test SANITIZE=address`
+// to check that replaced and partially decoded values are freed.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bind.h"
+#include "bytes.h"
+#include "check.h"
+#include "json.h"
+
+typedef struct {
+    char *city;
+    int64_t zip;
+} Address;
+
+typedef struct {
+    int64_t id;
+    char *name;
+    char *nickname;
+    double score;
+    bool active;
+    Address address;
+    JsonBoundArray tags;   /* char * */
+    JsonBoundArray scores; /* int64_t */
+} User;
+
+typedef struct {
+    char *name;
+    JsonBoundArray members; /* User */
+} Team;
+
+typedef struct {
+    int64_t value;
+    JsonBoundArray children; /* Node */
+} Node;
+
+static JsonField address_fields[] = {
+    JSON_FIELD(Address, city, JSON_FIELD_STRING),
+    JSON_FIELD(Address, zip, JSON_FIELD_INT),
+};
+static JsonBinding address_binding = JSON_BINDING(Address, address_fields);
+
+static JsonField user_fields[] = {
+    JSON_FIELD(User, id, JSON_FIELD_INT),
+    JSON_FIELD(User, name, JSON_FIELD_STRING),
+    JSON_FIELD_NAMED(User, nickname, "a nickname long enough to span chunks",
+                     JSON_FIELD_STRING),
+    JSON_FIELD(User, score, JSON_FIELD_DOUBLE),
+    JSON_FIELD(User, active, JSON_FIELD_BOOL),
+    JSON_FIELD_STRUCT(User, address, &address_binding),
+    JSON_FIELD_ARRAY(User, tags, JSON_FIELD_STRING, NULL),
+    JSON_FIELD_ARRAY(User, scores, JSON_FIELD_INT, NULL),
+};
+static JsonBinding user_binding = JSON_BINDING(User, user_fields);
+
+static JsonField team_fields[] = {
+    JSON_FIELD(Team, name, JSON_FIELD_STRING),
+    JSON_FIELD_ARRAY(Team, members, JSON_FIELD_OBJECT, &user_binding),
+};
+static JsonBinding team_binding = JSON_BINDING(Team, team_fields);
+
+static JsonBinding node_binding;
+static JsonField node_fields[] = {
+    JSON_FIELD(Node, value, JSON_FIELD_INT),
+    JSON_FIELD_ARRAY(Node, children, JSON_FIELD_OBJECT, &node_binding),
+};
+static JsonBinding node_binding = JSON_BINDING(Node, node_fields);
+
+// arrays can't hold arrays, there is no member to bind the inner ones to
+typedef struct {
+    JsonBoundArray rows;
+} Matrix;
+
+static JsonField matrix_fields[] = {
+    JSON_FIELD_ARRAY(Matrix, rows, JSON_FIELD_ARRAY, NULL),
+};
+static JsonBinding matrix_binding = JSON_BINDING(Matrix, matrix_fields);
+
+static bool decode(const char *data, JsonBinding *binding, void *out,
+                   bool by_byte) {
+    Source *source = by_byte ? source_bytes(data)
+                             : source_from_memory(data, strlen(data), "memory");
+    bool ok = json_decode(source, binding, out);
+    source_close(&source);
+    return ok;
+}
+
+static bool is_zeroed(const void *value, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (((const char *)value)[i] != 0)
+            return false;
+    }
+    return true;
+}
+
+static bool string_is(const char *s, const char *expected) {
+    return s != NULL && strcmp(s, expected) == 0;
+}
+
+static void test_nested(bool by_byte) {
+    const char *data =
+        "{\"id\": 42, \"name\": \"Ada\", \"score\": 9.5, \"active\": true,"
+        " \"unknown\": {\"deep\": [1, {\"x\": \"y\"}]},"
+        " \"address\": {\"zip\": 12345, \"city\": \"Zurich\", \"extra\": 1},"
+        " \"tags\": [\"admin\", \"ops\", \"\"], \"scores\": [1, -2, 3],"
+        " \"a nickname long enough to span chunks\": \"countess\"}";
+
+    User user;
+    CHECK(decode(data, &user_binding, &user, by_byte));
+    CHECK(user.id == 42 && string_is(user.name, "Ada"));
+    CHECK(string_is(user.nickname, "countess"));
+    CHECK(user.score == 9.5 && user.active);
+    CHECK(string_is(user.address.city, "Zurich") &&
+          user.address.zip == 12345);
+
+    CHECK(user.tags.n == 3);
+    if (user.tags.n == 3) {
+        char **tags = (char **)user.tags.arr;
+        CHECK(string_is(tags[0], "admin") && string_is(tags[1], "ops") &&
+              string_is(tags[2], ""));
+    }
+    CHECK(user.scores.n == 3);
+    if (user.scores.n == 3) {
+        int64_t *scores = (int64_t *)user.scores.arr;
+        CHECK(scores[0] == 1 && scores[1] == -2 && scores[2] == 3);
+    }
+
+    json_binding_free(&user_binding, &user);
+    CHECK(is_zeroed(&user, sizeof(user)));
+}
+
+static void test_array_of_structs(bool by_byte) {
+    const char *data =
+        "{\"name\": \"core\", \"members\": ["
+        "{\"id\": 1, \"name\": \"one\", \"tags\": [\"a\"]},"
+        "{\"id\": 2, \"address\": {\"city\": \"Bern\"}},"
+        "{},"
+        "{\"id\": 4, \"name\": null}]}";
+
+    Team team;
+    CHECK(decode(data, &team_binding, &team, by_byte));
+    CHECK(string_is(team.name, "core"));
+
+    CHECK(team.members.n == 4);
+    if (team.members.n == 4) {
+        User *users = (User *)team.members.arr;
+        CHECK(users[0].id == 1 && string_is(users[0].name, "one"));
+        CHECK(users[0].tags.n == 1 &&
+              string_is(((char **)users[0].tags.arr)[0], "a"));
+        CHECK(users[1].id == 2 && users[1].name == NULL);
+        CHECK(string_is(users[1].address.city, "Bern"));
+        CHECK(is_zeroed(&users[2], sizeof(User)));
+        CHECK(users[3].id == 4 && users[3].name == NULL);
+    }
+
+    json_binding_free(&team_binding, &team);
+}
+
+static int64_t node_sum(const Node *node, size_t *count) {
+    int64_t sum = node->value;
+    (*count)++;
+    for (size_t i = 0; i < node->children.n; i++)
+        sum += node_sum(&((Node *)node->children.arr)[i], count);
+    return sum;
+}
+
+static void test_self_reference(bool by_byte) {
+    const char *data =
+        "{\"value\": 1, \"children\": ["
+        "{\"value\": 2, \"children\": [{\"value\": 4}, {\"value\": 5,"
+        " \"children\": [{\"value\": 8, \"children\": []}]}]},"
+        "{\"value\": 3}]}";
+
+    Node root;
+    CHECK(decode(data, &node_binding, &root, by_byte));
+
+    size_t count = 0;
+    CHECK(node_sum(&root, &count) == 23 && count == 6);
+    CHECK(root.children.n == 2);
+
+    json_binding_free(&node_binding, &root);
+
+    // a failure deep down frees the levels above it
+    CHECK(!decode("{\"value\": 1, \"children\": [{\"value\": 2, \"children\":"
+                  " [{\"value\": \"3\"}]}]}",
+                  &node_binding, &root, by_byte));
+    CHECK(is_zeroed(&root, sizeof(root)));
+}
+
+static void test_repeated_keys(bool by_byte) {
+    const char *data =
+        "{\"name\": \"first\", \"tags\": [\"a\", \"b\"],"
+        " \"address\": {\"city\": \"Basel\", \"zip\": 4000},"
+        " \"name\": \"second\", \"tags\": [\"c\"],"
+        " \"address\": {\"zip\": 8000}, \"name\": null}";
+
+    User user;
+    CHECK(decode(data, &user_binding, &user, by_byte));
+    // null replaces an earlier value too, and leaves the member zeroed
+    CHECK(user.name == NULL);
+    CHECK(user.tags.n == 1 && string_is(((char **)user.tags.arr)[0], "c"));
+    CHECK(user.address.city == NULL && user.address.zip == 8000);
+    json_binding_free(&user_binding, &user);
+}
+
+static void test_type_mismatch(bool by_byte) {
+    static const char *bad[] = {
+        "{\"id\": 1.5}",
+        "{\"id\": \"1\"}",
+        "{\"name\": 1}",
+        "{\"active\": \"yes\"}",
+        "{\"score\": true}",
+        "{\"address\": []}",
+        "{\"tags\": {}}",
+        "{\"name\": \"x\", \"tags\": [\"a\", \"b\", 3]}",
+        "{\"name\": \"x\", \"address\": {\"city\": \"y\", \"zip\": \"z\"}}",
+        "{\"name\": \"x\", \"scores\": [1, 2}",
+        "{\"name\": \"x\", \"tags\": [\"a\"]",
+        "{\"name\": \"x\" \"id\": 1}",
+        "[]",
+    };
+
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        User user;
+        if (decode(bad[i], &user_binding, &user, by_byte)) {
+            FAIL("%s was decoded", bad[i]);
+            json_binding_free(&user_binding, &user);
+        } else if (!is_zeroed(&user, sizeof(user))) {
+            FAIL("%s left a partial value", bad[i]);
+        }
+    }
+
+    Team team;
+    CHECK(!decode("{\"name\": \"t\", \"members\": [{\"id\": 1, \"tags\":"
+                  " [\"a\"]}, {\"id\": 2, \"scores\": [1.5]}]}",
+                  &team_binding, &team, by_byte));
+    CHECK(is_zeroed(&team, sizeof(team)));
+}
+
+static void test_long_lexemes(bool by_byte) {
+    size_t n = 5000;
+    char *data = (char *)malloc(2 * n + 256);
+    char *long_name = (char *)malloc(n + 1);
+
+    for (size_t i = 0; i < n; i++)
+        long_name[i] = 'a' + i % 26;
+    long_name[n] = 0;
+
+    // numbers longer than the stack copy decode_number makes
+    const char *score = "0.000000000000000000000000000000000000000000000000000"
+                        "00000000000000000000000000000000000000000000000000125";
+    snprintf(data, 2 * n + 256, "{\"%s\": 1, \"name\": \"%s\", \"score\": %s}",
+             long_name, long_name, score);
+
+    User user;
+    CHECK(decode(data, &user_binding, &user, by_byte));
+    CHECK(string_is(user.name, long_name));
+    CHECK(user.score == strtod(score, NULL));
+    json_binding_free(&user_binding, &user);
+
+    free(long_name);
+    free(data);
+}
+
+int main(void) {
+    CHECK(json_binding_compile(&team_binding));
+    CHECK(json_binding_compile(&node_binding));
+    CHECK(!json_binding_compile(&matrix_binding));
+
+    for (int by_byte = 0; by_byte <= 1; by_byte++) {
+        test_nested(by_byte);
+        test_array_of_structs(by_byte);
+        test_self_reference(by_byte);
+        test_repeated_keys(by_byte);
+        test_type_mismatch(by_byte);
+        test_long_lexemes(by_byte);
+    }
+
+    return check_finish("bind");
+}
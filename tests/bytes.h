@@ -0,0 +1,39 @@
+#ifndef __BYTES_H__
+#define __BYTES_H__
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "source.h"
+
+// A source without span or borrow that returns a single byte per read, so
+// that every lexeme read from it is split across chunks.
+
+typedef struct {
+    Source base;
+    const char *data;
+    size_t len;
+    size_t at;
+} ByteSource;
+
+static inline ssize_t byte_read(Source *source, char *buf, size_t n) {
+    ByteSource *bytes = (ByteSource *)source;
+    if (bytes->at == bytes->len || n == 0)
+        return 0;
+    buf[0] = bytes->data[bytes->at++];
+    return 1;
+}
+
+static inline void byte_close(Source *source) { free(source); }
+
+// reads the nul terminated data, which must outlive the source
+static inline Source *source_bytes(const char *data) {
+    ByteSource *bytes = (ByteSource *)calloc(1, sizeof(ByteSource));
+    bytes->base = (Source){
+        .read = byte_read, .close = byte_close, .name = "bytes"};
+    bytes->data = data;
+    bytes->len = strlen(data);
+    return &bytes->base;
+}
+
+#endif // __BYTES_H__
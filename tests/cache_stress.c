@@ -0,0 +1,178 @@
+// Threads share cached documents while one of the files is rewritten and a
+// small budget keeps evicting, then diff a shared packed tree. Run it under
+// `make test SANITIZE=thread` to check for races.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "json.h"
+
+#define THREADS 8
+#define ROUNDS 200
+#define REWRITES 5
+
+static char dir[] = "/tmp/json-cache-XXXXXX";
+static char paths[3][64];
+static Json *packed_a, *packed_b;
+
+static void write_file(const char *path, const char *contents) {
+    char tmp[80];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    FILE *fp = fopen(tmp, "w");
+    CHECK(fp != NULL);
+    if (fp == NULL)
+        return;
+    fputs(contents, fp);
+    fclose(fp);
+
+    // renamed into place, so readers see either version in full
+    CHECK(rename(tmp, path) == 0);
+}
+
+static void write_numbers(const char *path, size_t n) {
+    size_t len = n * 24 + 16;
+    char *buf = (char *)malloc(len);
+    size_t at = snprintf(buf, len, "{\"v\":[");
+
+    for (size_t i = 0; i < n; i++)
+        at += snprintf(buf + at, len - at, "%s%zu", i > 0 ? "," : "", i * 7);
+    snprintf(buf + at, len - at, "]}");
+
+    write_file(path, buf);
+    free(buf);
+}
+
+static void *cache_worker(void *arg) {
+    size_t id = (size_t)arg;
+
+    for (size_t i = 0; i < ROUNDS; i++) {
+        JsonDocument *document = json_parse_cached(paths[(i + id) % 3]);
+        CHECK(document != NULL);
+        if (document == NULL)
+            continue;
+
+        Json *root = json_document_root(document);
+        CHECK(root->type == JSON_OBJECT && root->value.object.n == 1);
+        json_hash(root);
+        json_document_release(&document);
+    }
+    return NULL;
+}
+
+static void *diff_worker(void *arg) {
+    (void)arg;
+
+    for (size_t i = 0; i < ROUNDS / 10; i++) {
+        JsonDiff *diff = json_diff(packed_a, packed_b);
+        CHECK(diff != NULL && diff->n == 8);
+        if (diff != NULL)
+            json_diff_free(&diff);
+    }
+    return NULL;
+}
+
+static void run(void *(*worker)(void *)) {
+    pthread_t threads[THREADS];
+
+    for (size_t i = 0; i < THREADS; i++)
+        pthread_create(&threads[i], NULL, worker, (void *)i);
+    for (size_t i = 0; i < THREADS; i++)
+        pthread_join(threads[i], NULL);
+}
+
+static void test_cache(void) {
+    write_numbers(paths[0], 20000);
+    write_numbers(paths[1], 100);
+    write_file(paths[2], "{\"v\":[0]}");
+
+    // small enough that the large file keeps being evicted
+    json_cache_set_budget(512 * 1024);
+
+    pthread_t threads[THREADS];
+    for (size_t i = 0; i < THREADS; i++)
+        pthread_create(&threads[i], NULL, cache_worker, (void *)i);
+
+    for (int k = 1; k <= REWRITES; k++) {
+        char contents[32];
+        usleep(10000);
+        snprintf(contents, sizeof(contents), "{\"v\":[%d,2.5]}", k);
+        write_file(paths[2], contents);
+    }
+
+    for (size_t i = 0; i < THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    JsonDocument *a = json_parse_cached(paths[2]);
+    JsonDocument *b = json_parse_cached(paths[2]);
+    CHECK(a != NULL && a == b);
+    if (a == NULL || b == NULL)
+        return;
+
+    // held documents outlive the cache entry
+    json_cache_clear();
+    Json *v = json_document_root(b)->value.object.arr[0].value;
+    CHECK(v->value.array.n == 2);
+    CHECK(json_number_int(v->value.array.arr[0]->value.number) == REWRITES);
+
+    json_document_release(&a);
+    json_document_release(&b);
+    json_cache_set_budget(JSON_CACHE_DEFAULT_BUDGET);
+}
+
+static Json *parse_rows(int changed_every) {
+    char buf[4096];
+    size_t at = snprintf(buf, sizeof(buf), "[");
+
+    for (int i = 0; i < 50; i++) {
+        int last = changed_every > 0 && i % changed_every == 0 ? -1 : i * 3;
+        at += snprintf(buf + at, sizeof(buf) - at, "%s[%d,%d,%d]",
+                       i > 0 ? "," : "", i, i * 2, last);
+    }
+    snprintf(buf + at, sizeof(buf) - at, "]");
+
+    Source *source = source_from_memory(buf, strlen(buf), "rows");
+    Json *json = json_parse_source_packed(source);
+    source_close(&source);
+    return json;
+}
+
+static void test_shared_packed_diff(void) {
+    packed_a = parse_rows(0);
+    packed_b = parse_rows(7);
+    CHECK(packed_a != NULL && packed_b != NULL);
+    if (packed_a == NULL || packed_b == NULL)
+        return;
+
+    // shared trees are hashed before they are handed out
+    json_hash(packed_a);
+    json_hash(packed_b);
+
+    // every thread boxes the same rows, only one copy may be kept
+    run(diff_worker);
+
+    json_free(&packed_a);
+    json_free(&packed_b);
+}
+
+int main(void) {
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    for (size_t i = 0; i < 3; i++)
+        snprintf(paths[i], sizeof(paths[i]), "%s/%zu.json", dir, i);
+
+    test_cache();
+    test_shared_packed_diff();
+
+    for (size_t i = 0; i < 3; i++)
+        unlink(paths[i]);
+    rmdir(dir);
+
+    return check_finish("cache_stress");
+}
@@ -0,0 +1,35 @@
+#ifndef __CHECK_H__
+#define __CHECK_H__
+
+#include <stdatomic.h>
+#include <stdio.h>
+
+// Every test is a single program including this header. Failed checks are
+// reported and counted, and the test keeps going so that one run shows all
+// of them.
+
+// counted atomically, checks also run on worker threads
+static atomic_int failures;
+
+#define FAIL(format, ...)                                                      \
+    do {                                                                       \
+        fprintf(stderr, "%s:%d: " format "\n", __FILE__, __LINE__,             \
+                ##__VA_ARGS__);                                                \
+        atomic_fetch_add(&failures, 1);                                        \
+    } while (0)
+
+#define CHECK(cond)                                                            \
+    do {                                                                       \
+        if (!(cond))                                                           \
+            FAIL("check failed: %s", #cond);                                   \
+    } while (0)
+
+// exit status of the test, reporting success under name
+static inline int check_finish(const char *name) {
+    if (atomic_load(&failures) > 0)
+        return 1;
+    printf("%s: ok\n", name);
+    return 0;
+}
+
+#endif // __CHECK_H__
@@ -0,0 +1,137 @@
+// Checks the JSON Patch written for json_diff and that json_equal agrees with
+// it: large ints that round to the same double, ints against equal floats,
+// reordered keys, arrays that grow and shrink, and keys that need escaping
+// in pointers. Every case runs on boxed and on packed trees.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "json.h"
+
+static Json *parse(const char *data, bool packed) {
+    Source *source = source_from_memory(data, strlen(data), "memory");
+    Json *json =
+        packed ? json_parse_source_packed(source) : json_parse_source(source);
+    source_close(&source);
+    return json;
+}
+
+// expected is the patch turning a into b, "[]" when they are equal
+static void check_patch(const char *a, const char *b, const char *expected) {
+    for (int packed = 0; packed <= 1; packed++) {
+        Json *ja = parse(a, packed), *jb = parse(b, packed);
+        CHECK(ja != NULL && jb != NULL);
+        if (ja == NULL || jb == NULL)
+            continue;
+
+        bool equal = strcmp(expected, "[]") == 0;
+        if (json_equal(ja, jb) != equal)
+            FAIL("%s vs %s, %s: json_equal gave %d", a, b,
+                 packed ? "packed" : "boxed", !equal);
+
+        JsonDiff *diff = json_diff(ja, jb);
+        CHECK(diff != NULL);
+        if (diff != NULL) {
+            char *out = NULL;
+            size_t len;
+            FILE *fp = open_memstream(&out, &len);
+            json_diff_fprint_patch(fp, diff);
+            fclose(fp);
+
+            if (len == 0 || out[len - 1] != '\n' ||
+                strncmp(out, expected, len - 1) != 0 ||
+                strlen(expected) != len - 1)
+                FAIL("%s vs %s, %s:\n  got      %s  expected %s", a, b,
+                     packed ? "packed" : "boxed", out, expected);
+            free(out);
+            json_diff_free(&diff);
+        }
+
+        json_free(&ja);
+        json_free(&jb);
+    }
+}
+
+static void test_numbers(void) {
+    // 2^53 + 1 and 2^53 are the same double
+    check_patch("[9007199254740993]", "[9007199254740992]",
+                "[{\"op\":\"replace\",\"path\":\"/0\",\"value\":"
+                "9007199254740992}]");
+    check_patch("{\"n\":9007199254740993}", "{\"n\":9007199254740992.0}",
+                "[{\"op\":\"replace\",\"path\":\"/n\",\"value\":"
+                "9007199254740992.0}]");
+    // both round to 2^63
+    check_patch("[1,9223372036854775807]", "[1,9223372036854775806]",
+                "[{\"op\":\"replace\",\"path\":\"/1\",\"value\":"
+                "9223372036854775806}]");
+    check_patch("[-9223372036854775807]", "[-9223372036854775808]",
+                "[{\"op\":\"replace\",\"path\":\"/0\",\"value\":"
+                "-9223372036854775808}]");
+
+    check_patch("{\"a\":1}", "{\"a\":1.0}", "[]");
+    check_patch("[1,2,3]", "[1.0,2,3e0]", "[]");
+    check_patch("[-0]", "[0.0]", "[]");
+    check_patch("[9007199254740992]", "[9007199254740992.0]", "[]");
+    check_patch("{\"a\":1}", "{\"a\":1.5}",
+                "[{\"op\":\"replace\",\"path\":\"/a\",\"value\":1.5}]");
+    check_patch("[1]", "[\"1\"]",
+                "[{\"op\":\"replace\",\"path\":\"/0\",\"value\":\"1\"}]");
+}
+
+static void test_objects(void) {
+    check_patch("{\"a\":1,\"b\":[1,2],\"c\":{\"d\":null}}",
+                "{\"c\":{\"d\":null},\"a\":1,\"b\":[1,2]}", "[]");
+    check_patch("{\"a\":1,\"b\":2}", "{\"b\":3,\"a\":1}",
+                "[{\"op\":\"replace\",\"path\":\"/b\",\"value\":3}]");
+    check_patch("{\"a\":1,\"b\":2}", "{\"c\":[3],\"a\":1}",
+                "[{\"op\":\"remove\",\"path\":\"/b\"},"
+                "{\"op\":\"add\",\"path\":\"/c\",\"value\":[3]}]");
+    check_patch("{\"a\":{\"x\":true}}", "{\"a\":{\"x\":false,\"y\":null}}",
+                "[{\"op\":\"replace\",\"path\":\"/a/x\",\"value\":false},"
+                "{\"op\":\"add\",\"path\":\"/a/y\",\"value\":null}]");
+    check_patch("{\"a\":[1]}", "{\"a\":{\"0\":1}}",
+                "[{\"op\":\"replace\",\"path\":\"/a\",\"value\":{\"0\":1}}]");
+}
+
+static void test_arrays(void) {
+    check_patch("[1,2]", "[1,2,3,4]",
+                "[{\"op\":\"add\",\"path\":\"/2\",\"value\":3},"
+                "{\"op\":\"add\",\"path\":\"/3\",\"value\":4}]");
+    // removed from the end, so that applying them in order is valid
+    check_patch("[1,2,3,4]", "[1,5]",
+                "[{\"op\":\"replace\",\"path\":\"/1\",\"value\":5},"
+                "{\"op\":\"remove\",\"path\":\"/3\"},"
+                "{\"op\":\"remove\",\"path\":\"/2\"}]");
+    check_patch("[[1],[2,3]]", "[[1],[2]]",
+                "[{\"op\":\"remove\",\"path\":\"/1/1\"}]");
+    check_patch("[1,2]", "[]",
+                "[{\"op\":\"remove\",\"path\":\"/1\"},"
+                "{\"op\":\"remove\",\"path\":\"/0\"}]");
+    check_patch("[]", "[{\"a\":1}]",
+                "[{\"op\":\"add\",\"path\":\"/0\",\"value\":{\"a\":1}}]");
+}
+
+static void test_pointer_escapes(void) {
+    check_patch("{\"a/b\":1,\"m~n\":2,\"~/\":{\"k\":1}}",
+                "{\"a/b\":2,\"m~n\":3,\"~/\":{\"k\":2}}",
+                "[{\"op\":\"replace\",\"path\":\"/a~1b\",\"value\":2},"
+                "{\"op\":\"replace\",\"path\":\"/m~0n\",\"value\":3},"
+                "{\"op\":\"replace\",\"path\":\"/~0~1/k\",\"value\":2}]");
+    check_patch("{\"~1\":[0]}", "{\"~1\":[0,1],\"/\":0}",
+                "[{\"op\":\"add\",\"path\":\"/~01/1\",\"value\":1},"
+                "{\"op\":\"add\",\"path\":\"/~1\",\"value\":0}]");
+    check_patch("{\"\":1}", "{\"\":2}",
+                "[{\"op\":\"replace\",\"path\":\"/\",\"value\":2}]");
+}
+
+int main(void) {
+    test_numbers();
+    test_objects();
+    test_arrays();
+    test_pointer_escapes();
+
+    return check_finish("diff");
+}
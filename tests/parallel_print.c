@@ -0,0 +1,151 @@
+// Checks that json_fprint_parallel writes exactly what json_fprint does, for
+// boxed and packed trees, into a file and into a pipe drained slowly enough
+// that the workers have to wait for the writer.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "json.h"
+
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t capacity;
+} Drain;
+
+// reads the pipe in small pieces with pauses
+static void *drain_thread(void *arg) {
+    Drain *drain = (Drain *)arg;
+    size_t reads = 0;
+
+    while (true) {
+        if (drain->len + 4096 > drain->capacity) {
+            drain->capacity = drain->capacity * 2 + 4096;
+            drain->buf = (char *)realloc(drain->buf, drain->capacity);
+        }
+
+        ssize_t got = read(drain->fd, drain->buf + drain->len, 4096);
+        if (got <= 0)
+            break;
+        drain->len += got;
+
+        if (++reads % 64 == 0)
+            usleep(1000);
+    }
+    return NULL;
+}
+
+static char *print_serial(Json *json, int indent, size_t *len) {
+    char *buf = NULL;
+    FILE *fp = open_memstream(&buf, len);
+    json_fprint(fp, json, indent);
+    fclose(fp);
+    return buf;
+}
+
+static char *print_to_file(Json *json, int indent, int threads, size_t *len) {
+    FILE *fp = tmpfile();
+    json_fprint_parallel(fp, json, indent, threads);
+    fflush(fp);
+
+    *len = ftell(fp);
+    char *buf = (char *)malloc(*len + 1);
+    rewind(fp);
+    CHECK(fread(buf, 1, *len, fp) == *len);
+    fclose(fp);
+    return buf;
+}
+
+static char *print_to_pipe(Json *json, int indent, int threads, size_t *len) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        FAIL("pipe: %s", strerror(errno));
+        *len = 0;
+        return NULL;
+    }
+
+    Drain drain = {.fd = fds[0]};
+    pthread_t thread;
+    pthread_create(&thread, NULL, drain_thread, &drain);
+
+    FILE *fp = fdopen(fds[1], "w");
+    json_fprint_parallel(fp, json, indent, threads);
+    fclose(fp);
+
+    pthread_join(thread, NULL);
+    close(fds[0]);
+    *len = drain.len;
+    return drain.buf;
+}
+
+static void check_prints(Json *json, const char *name) {
+    static const int threads[] = {1, 2, 4, 8};
+
+    for (int indent = 0; indent <= 2; indent += 2) {
+        size_t expected_len;
+        char *expected = print_serial(json, indent, &expected_len);
+
+        for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+            size_t len;
+            char *out = print_to_file(json, indent, threads[t], &len);
+            if (len != expected_len || memcmp(out, expected, len) != 0)
+                FAIL("%s: file output differs, indent %d, %d threads", name,
+                     indent, threads[t]);
+            free(out);
+
+            out = print_to_pipe(json, indent, threads[t], &len);
+            if (len != expected_len || memcmp(out, expected, len) != 0)
+                FAIL("%s: pipe output differs, indent %d, %d threads", name,
+                     indent, threads[t]);
+            free(out);
+        }
+        free(expected);
+    }
+}
+
+int main(void) {
+    size_t cap = 4 << 20, len = 0;
+    char *data = (char *)malloc(cap);
+
+    // large enough to be split into segments, with large arrays nested in
+    // small containers and arrays of numbers that pack
+    len += snprintf(data + len, cap - len, "{\"rows\":[");
+    for (int i = 0; i < 20000; i++)
+        len += snprintf(data + len, cap - len,
+                        "%s{\"id\":%d,\"name\":\"row %d\",\"ok\":%s}",
+                        i > 0 ? "," : "", i, i, i % 3 ? "true" : "null");
+    len += snprintf(data + len, cap - len, "],\"meta\":{\"series\":[");
+    for (int i = 0; i < 30000; i++)
+        len += snprintf(data + len, cap - len, "%s%d.25", i > 0 ? "," : "", i);
+    len += snprintf(data + len, cap - len, "],\"ints\":[");
+    for (int i = 0; i < 30000; i++)
+        len += snprintf(data + len, cap - len, "%s%d", i > 0 ? "," : "", -i);
+    len += snprintf(data + len, cap - len, "]}}");
+
+    Source *source = source_from_memory(data, len, "boxed");
+    Json *boxed = json_parse_source(source);
+    source_close(&source);
+
+    source = source_from_memory(data, len, "packed");
+    Json *packed = json_parse_source_packed(source);
+    source_close(&source);
+
+    CHECK(boxed != NULL && packed != NULL);
+    if (boxed != NULL) {
+        check_prints(boxed, "boxed");
+        json_free(&boxed);
+    }
+    if (packed != NULL) {
+        check_prints(packed, "packed");
+        json_free(&packed);
+    }
+    free(data);
+
+    return check_finish("parallel_print");
+}
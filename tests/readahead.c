@@ -0,0 +1,185 @@
+// Parses from pipes through the read-ahead source: a peer that waits for a
+// reply before closing, a writer trickling a document in uneven pieces, a
+// source closed while its peer is silent, and an input that can't be read.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "json.h"
+
+// a stalled parse fails the test instead of hanging it
+#define TIMEOUT_SECONDS 20
+
+typedef struct {
+    int fd;
+    const char *data;
+    size_t len;
+    bool trickle;        /* write in small uneven pieces with pauses */
+    bool wait_for_reply; /* keep the pipe open until replied is set */
+    bool replied;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} Writer;
+
+static void *writer_thread(void *arg) {
+    Writer *writer = (Writer *)arg;
+    size_t at = 0;
+    unsigned seed = 1;
+
+    while (at < writer->len) {
+        size_t n = writer->len - at;
+        if (writer->trickle) {
+            seed = seed * 1103515245 + 12345;
+            size_t piece = 1 + (seed >> 16) % 3000;
+            if (n > piece)
+                n = piece;
+            if ((seed >> 8) % 8 == 0)
+                usleep(1000);
+        }
+
+        ssize_t written = write(writer->fd, writer->data + at, n);
+        if (written <= 0)
+            break;
+        at += written;
+    }
+
+    if (writer->wait_for_reply) {
+        pthread_mutex_lock(&writer->lock);
+        while (!writer->replied)
+            pthread_cond_wait(&writer->cond, &writer->lock);
+        pthread_mutex_unlock(&writer->lock);
+    }
+
+    close(writer->fd);
+    return NULL;
+}
+
+// parses data written to a pipe by a writer thread
+static Json *parse_piped(const char *data, size_t len, bool trickle,
+                         bool wait_for_reply, size_t buffer_length) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        FAIL("pipe: %s", strerror(errno));
+        return NULL;
+    }
+
+    Writer writer = {.fd = fds[1],
+                     .data = data,
+                     .len = len,
+                     .trickle = trickle,
+                     .wait_for_reply = wait_for_reply,
+                     .lock = PTHREAD_MUTEX_INITIALIZER,
+                     .cond = PTHREAD_COND_INITIALIZER};
+    pthread_t thread;
+    pthread_create(&thread, NULL, writer_thread, &writer);
+
+    Source *source = source_readahead(source_from_fd(fds[0], "pipe"),
+                                      buffer_length);
+    CHECK(source != NULL);
+    Json *json = source != NULL ? json_parse_source(source) : NULL;
+
+    // the peer only closes once it has its reply, which comes after the
+    // source is done with
+    if (source != NULL && wait_for_reply)
+        source_close(&source);
+
+    pthread_mutex_lock(&writer.lock);
+    writer.replied = true;
+    pthread_cond_signal(&writer.cond);
+    pthread_mutex_unlock(&writer.lock);
+
+    pthread_join(thread, NULL);
+    if (source != NULL)
+        source_close(&source);
+    close(fds[0]);
+    return json;
+}
+
+static void test_request_response(void) {
+    const char *request = "{\"id\":7,\"args\":[1,2,3]}";
+
+    // far less than a read-ahead buffer, and no end of input until the
+    // reply
+    Json *json = parse_piped(request, strlen(request), false, true, 0);
+    CHECK(json != NULL && json->type == JSON_OBJECT);
+    if (json != NULL)
+        json_free(&json);
+}
+
+static void test_trickle(void) {
+    size_t cap = 1 << 20, len = 0;
+    char *data = (char *)malloc(cap);
+
+    len += snprintf(data + len, cap - len, "[");
+    for (int i = 0; i < 5000; i++)
+        len += snprintf(data + len, cap - len,
+                        "%s{\"id\":%d,\"name\":\"row %d\",\"v\":[%d.5,%d]}",
+                        i > 0 ? "," : "", i, i, i, -i);
+    len += snprintf(data + len, cap - len, "]");
+
+    Source *memory = source_from_memory(data, len, "memory");
+    Json *expected = json_parse_source(memory);
+    source_close(&memory);
+
+    // small buffers so that lexemes keep crossing chunks
+    Json *json = parse_piped(data, len, true, false, 4096);
+    CHECK(expected != NULL && json != NULL);
+    if (expected != NULL && json != NULL)
+        CHECK(json_equal(expected, json));
+
+    if (json != NULL)
+        json_free(&json);
+    if (expected != NULL)
+        json_free(&expected);
+    free(data);
+}
+
+static void test_close_idle(void) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        FAIL("pipe: %s", strerror(errno));
+        return;
+    }
+
+    // the reader thread is waiting for input that never comes
+    Source *source = source_readahead(source_from_fd(fds[0], "pipe"), 0);
+    CHECK(source != NULL);
+    usleep(10000);
+    if (source != NULL)
+        source_close(&source);
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void test_read_error(void) {
+    // reading a directory fails with EISDIR
+    int fd = open(".", O_RDONLY);
+    CHECK(fd >= 0);
+    if (fd < 0)
+        return;
+
+    Source *source = source_readahead(source_from_fd(fd, "."), 0);
+    char buf[16];
+    CHECK(source_read(source, buf, sizeof(buf)) == -1);
+    source_close(&source);
+    close(fd);
+}
+
+int main(void) {
+    alarm(TIMEOUT_SECONDS);
+
+    test_request_response();
+    test_trickle();
+    test_close_idle();
+    test_read_error();
+
+    return check_finish("readahead");
+}
@@ -0,0 +1,120 @@
+// Checks that json_reformat writes exactly what parsing and json_fprint do,
+// reading in place and through a source that returns one byte per read so
+// that every lexeme is split across chunks, and that malformed input is
+// rejected.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytes.h"
+#include "check.h"
+#include "json.h"
+
+// reformats data read from a memory or one byte source, NULL when rejected
+static char *reformat(const char *data, int indent, bool by_byte) {
+    Source *source = by_byte ? source_bytes(data)
+                             : source_from_memory(data, strlen(data), "memory");
+    char *buf = NULL;
+    size_t len;
+    FILE *fp = open_memstream(&buf, &len);
+
+    bool ok = json_reformat(source, fp, indent);
+    fclose(fp);
+    source_close(&source);
+
+    if (!ok) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+static char *print_parsed(const char *data, int indent) {
+    Source *source = source_from_memory(data, strlen(data), "memory");
+    Json *json = json_parse_source(source);
+    source_close(&source);
+    if (json == NULL)
+        return NULL;
+
+    char *buf = NULL;
+    size_t len;
+    FILE *fp = open_memstream(&buf, &len);
+    json_fprint(fp, json, indent);
+    fclose(fp);
+    json_free(&json);
+    return buf;
+}
+
+static void check_output(const char *data, int indent, const char *expected) {
+    for (int by_byte = 0; by_byte <= 1; by_byte++) {
+        char *out = reformat(data, indent, by_byte);
+        if (out == NULL || strcmp(out, expected) != 0)
+            FAIL("%s, indent %d, %s: got %s", data, indent,
+                 by_byte ? "by byte" : "in place", out ? out : "(rejected)");
+        free(out);
+    }
+}
+
+static void test_matches_print(void) {
+    static const char *docs[] = {
+        "{}",
+        "[]",
+        "[[], {}, [[]], {\"a\": {}}]",
+        "{\"a\": 1, \"b\": [true, false, null], \"c\": {\"d\": \"e\"}}",
+        "[0, -0, 12, -3.25, 1e10, 1E+2, 2.5e-3, 1234567890123456789]",
+        " \t\r\n[ \"spaced out\" ,\n\n \"keys: and, commas\" ] \n",
+        "{\"tab\\there\": \"line\\nbreak\", \"slash\": \"a\\/b\\\\\"}",
+        "[\"\\u00e9\\u20AC\", \"\\\\\", \"\\\\\\\\n\", \"\\b\\f\\r\"]",
+        "{\"rows\": [{\"id\": 1, \"name\": \"one\"}, {\"id\": 2, "
+        "\"name\": \"two\", \"tags\": [\"x\", \"y\"]}]}",
+    };
+
+    for (size_t i = 0; i < sizeof(docs) / sizeof(docs[0]); i++) {
+        for (int indent = 0; indent <= 4; indent += 2) {
+            char *expected = print_parsed(docs[i], indent);
+            CHECK(expected != NULL);
+            if (expected != NULL)
+                check_output(docs[i], indent, expected);
+            free(expected);
+        }
+    }
+}
+
+static void test_escaped_quotes(void) {
+    // the tree parser ends strings at any quote, so these are spelled out
+    check_output("{ \"say \\\"hi\\\"\" : [\"\\\"\", \"a\\\\\"] }", 0,
+                 "{\"say \\\"hi\\\"\":[\"\\\"\",\"a\\\\\"]}\n");
+    check_output("[\"\\\"]\"]", 2, "[\n  \"\\\"]\"\n]\n");
+}
+
+static void test_rejects(void) {
+    static const char *bad[] = {
+        "",        "01",          "[01]",      "[-01]",     "[1 2]",
+        "[1,]",    "{\"a\":1,}",  "{\"a\" 1}", "{1:2}",     "tru]",
+        "[tru]",   "[nul]",       "[-]",       "[1.]",      "[1e]",
+        "[.5]",    "[1]]",        "{}}",       "[1] 2",     "{} {}",
+        "[1][2]",  "[",           "[1,",       "{\"a\":",   "{\"a\"",
+        "[\"abc",  "[\"a\\",      "[1.",       "[tru",      "{\"a\":[1,2]",
+        "[1}",     "{\"a\":1]",   "\"root\"",  "1",
+    };
+
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        for (int by_byte = 0; by_byte <= 1; by_byte++) {
+            char *out = reformat(bad[i], 2, by_byte);
+            if (out != NULL)
+                FAIL("%s accepted %s: %s", bad[i],
+                     by_byte ? "by byte" : "in place", out);
+            free(out);
+        }
+    }
+}
+
+int main(void) {
+    test_matches_print();
+    test_escaped_quotes();
+    test_rejects();
+
+    return check_finish("reformat");
+}